@@ -0,0 +1,184 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dnsfwd {
+
+namespace {
+
+std::size_t align(std::size_t size)
+{
+  return (size + 7) & ~(std::size_t) 7;
+}
+
+void write_u16(char* p, std::uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value & 0xFF;
+}
+
+}
+
+// Mix the bits of a name hash (splitmix64 finalizer): the Bloom filter,
+// the buckets and the binary search use the resulting key.
+std::uint64_t blocklist_key(std::uint64_t hash)
+{
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+blocklist::blocklist(std::string const& path)
+  : data_(MAP_FAILED), size_(0)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Could not open blocklist " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(blocklist_header)) {
+    close(fd);
+    throw std::runtime_error("Invalid blocklist " + path);
+  }
+  size_ = st.st_size;
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED)
+    throw std::runtime_error("Could not map blocklist " + path);
+
+  const char* data = (const char*) data_;
+  header_ = (blocklist_header const*) data;
+  std::size_t bloom_size = header_->bloom_bits / 8;
+  std::size_t buckets_size = align((BLOCKLIST_BUCKETS + 1) * sizeof(std::uint32_t));
+  if (std::memcmp(header_->magic, BLOCKLIST_MAGIC, sizeof(BLOCKLIST_MAGIC)) != 0
+      || header_->version != BLOCKLIST_VERSION
+      || header_->bloom_bits < 64
+      || (header_->bloom_bits & (header_->bloom_bits - 1)) != 0
+      || bloom_size > size_ || header_->count > size_ / sizeof(std::uint64_t)
+      || size_ != sizeof(blocklist_header) + bloom_size + buckets_size
+        + header_->count * sizeof(std::uint64_t)) {
+    munmap(data_, size_);
+    throw std::runtime_error("Invalid blocklist " + path);
+  }
+  bloom_ = (std::uint64_t const*) (data + sizeof(blocklist_header));
+  buckets_ = (std::uint32_t const*) (data + sizeof(blocklist_header) + bloom_size);
+  keys_ = (std::uint64_t const*) (data + sizeof(blocklist_header) + bloom_size
+    + buckets_size);
+
+  // The lookups trust the bucket offsets: they must stay within the keys.
+  bool valid = buckets_[0] == 0
+    && buckets_[BLOCKLIST_BUCKETS] == header_->count;
+  for (std::size_t i = 0; valid && i != BLOCKLIST_BUCKETS; ++i)
+    valid = buckets_[i] <= buckets_[i + 1];
+  if (!valid) {
+    munmap(data_, size_);
+    throw std::runtime_error("Invalid blocklist " + path);
+  }
+}
+
+blocklist::~blocklist()
+{
+  munmap(data_, size_);
+}
+
+bool blocklist::contains_key(std::uint64_t key) const
+{
+  // The Bloom filter avoids touching the keys for most names:
+  std::uint64_t mask = header_->bloom_bits - 1;
+  std::uint64_t h1 = key;
+  std::uint64_t h2 = (key >> 32) | (key << 32) | 1;
+  for (std::uint32_t i = 0; i != header_->bloom_hashes; ++i) {
+    std::uint64_t bit = (h1 + i * h2) & mask;
+    if (!(bloom_[bit / 64] & ((std::uint64_t) 1 << (bit % 64))))
+      return false;
+  }
+
+  std::size_t bucket = key >> 48;
+  std::uint64_t const* begin = keys_ + buckets_[bucket];
+  std::uint64_t const* end = keys_ + buckets_[bucket + 1];
+  std::uint64_t const* i = std::lower_bound(begin, end, key);
+  return i != end && *i == key;
+}
+
+// Check if the (wire format) name or one of its parent domains is blocked:
+bool blocklist::contains(const char* name, std::size_t size) const
+{
+  const char* labels[MAX_LABELS];
+  std::size_t count = 0;
+  for (std::size_t pos = 0; pos < size && name[pos] != 0;
+      pos += (std::uint8_t) name[pos] + 1) {
+    if (count == MAX_LABELS)
+      return false;
+    labels[count++] = name + pos;
+  }
+
+  std::uint64_t hash = NAME_HASH_SEED;
+  for (std::size_t i = count; i != 0; --i) {
+    hash = hash_label(hash, labels[i - 1]);
+    if (this->contains_key(blocklist_key(hash)))
+      return true;
+  }
+  return false;
+}
+
+// Build the response to a blocked query in place: either NXDOMAIN or a
+// null address (0.0.0.0 or ::) for A and AAAA queries.
+std::size_t blocked_response(
+  char* buffer, message_view const& request, bool null_answer)
+{
+  std::size_t size = error_response(
+    buffer, request, null_answer ? 0 : RCODE_NXDOMAIN);
+  std::uint16_t type = request.qtype();
+  bool answer = null_answer && request.qclass() == 1
+    && (type == 1 || type == 28);
+  std::size_t rdlength = type == 1 ? 4 : 16;
+  if (!answer)
+    return size;
+
+  write_u16(buffer + 6, 1);
+  char* p = buffer + size;
+  write_u16(p, 0xC000 | MIN_MESSAGE_SIZE);
+  write_u16(p + 2, type);
+  write_u16(p + 4, 1);
+  write_u16(p + 6, 0);
+  write_u16(p + 8, 300);
+  write_u16(p + 10, rdlength);
+  std::memset(p + 12, 0, rdlength);
+  return size + 12 + rdlength;
+}
+
+}
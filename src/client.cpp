@@ -22,6 +22,7 @@ THE SOFTWARE.
 */
 
 #include "dnsfwd.hpp"
+#include "probes.hpp"
 
 #include <cstdint>
 #include <cstring>
@@ -33,16 +34,39 @@ THE SOFTWARE.
 
 #include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
-#include <boost/asio/connect.hpp>
 
 #include <boost/system/error_code.hpp>
 
 #include <memory>
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 namespace dnsfwd {
 
-client::client(boost::asio::io_service& io_service, service& service)
-  : io_service_(&io_service), service_(&service), socket_(io_service)
+const char PROBE_QUERY[sizeof(std::uint16_t) + PROBE_QUERY_SIZE] = {
+  0, PROBE_QUERY_SIZE,
+  PROBE_ID >> 8, PROBE_ID & 0xFF, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+  0, 0, 2, 0, 1 };
+
+client::client(boost::asio::io_service& io_service, service& service,
+    dnsfwd::upstream& upstream)
+  : io_service_(&io_service), service_(&service), upstream_(&upstream),
+    socket_(io_service),
+    pending_(0),
+    probe_queued_(false),
+    connecting_(false),
+    input_(INPUT_BUFFER_SIZE),
+    input_start_(0),
+    input_end_(0),
+    sending_(0),
+    probe_timer_(io_service),
+    probing_(false),
+    resolver_(io_service),
+    next_endpoint_(0),
+    connect_timer_(io_service)
 {
   LOG(DEBUG) << "New client\n";
 }
@@ -54,26 +78,43 @@ client::~client()
   LOG(DEBUG) << "Client deleted\n";
 }
 
-void client::clear(std::chrono::steady_clock::time_point time)
+std::size_t client::clear(message_time time)
 {
   size_t count = 0;
   while (!queue_.empty()) {
     auto i = queue_.begin();
     message& c = *i;
-    if (c.timestamp_ > time)
+    if (after(c.timestamp_, time))
       break;
     queue_.erase(i);
+    PROBE2(query__expired, &c, ntohs(c.client_id_));
     by_client_id_.erase_and_dispose(by_client_id_.iterator_to(c), deleter());
     count++;
   }
   if (count)
     LOG(DEBUG) << count << " requests dropped, "
       << by_client_id_.size() << " remaining\n";
+  return count;
+}
+
+// Answer SERVFAIL to the requests of a connection closed on a failure of its
+// upstream instead of dropping them with the connection. It must be closed
+// before the request being written is used again.
+void client::fail_requests()
+{
+  if (context_)
+    service_->fail(std::move(context_));
+  while (!queue_.empty()) {
+    message& c = queue_.front();
+    queue_.pop_front();
+    by_client_id_.erase(by_client_id_.iterator_to(c));
+    service_->fail(std::unique_ptr<message>(&c));
+  }
 }
 
 bool client::add_request(std::unique_ptr<message>& context)
 {
-  if (this->context_) {
+  if (this->context_ || !this->admitted()) {
     return false;
   } else {
     context_ = std::move(context);
@@ -86,45 +127,222 @@ std::uint16_t client::random_client_id()
 {
   while (1) {
     std::uint16_t id = service_->random_id();
+    if (id == PROBE_ID)
+      continue;
     auto i = this->by_client_id_.find(id, order_message_by_client_id());
     if (i == this->by_client_id_.end())
       return id;
   }
 }
 
+// Resolve the upstream and connect to its addresses in turn. The requests
+// wait until the connection is established:
 void client::connect()
 {
-  // TODO, make this async
   LOG(DEBUG) << "Connecting\n";
+  connecting_ = true;
+  self_ = this->shared_from_this();
+  // A retry on a failing upstream is bounded like a health check:
+  dnsfwd::config const& config = service_->config();
+  clock_type::duration timeout = CONNECT_TIMEOUT;
+  if (config.health_interval && (upstream_->down || upstream_->failures))
+    timeout = std::chrono::milliseconds(config.health_timeout);
+  pending_++;
+  connect_timer_.expires_from_now(timeout);
+  connect_timer_.async_wait(
+    boost::bind(
+      &client::on_connect_timer,
+      this,
+      boost::asio::placeholders::error
+    )
+  );
 
-  dnsfwd::endpoint const& endpoint = service_->tcp_connect_endpoints().at(0);
-
-  boost::asio::ip::tcp::resolver resolver(*io_service_);
+#ifdef DNSFWD_SIMULATION
+  boost::system::error_code ec = boost::asio::error::connection_refused;
+  int fd = simulated_connect();
+  if (fd >= 0)
+    socket_.assign(boost::asio::ip::tcp::v4(), fd, ec);
+  pending_++;
+  io_service_->post(boost::bind(&client::on_connect, this, ec));
+#else
+  dnsfwd::endpoint const& endpoint = upstream_->connect_tcp.at(0);
+  const char* default_port = endpoint.path.empty() ? "domain" : "https";
   boost::asio::ip::tcp::resolver::query query(
-    endpoint.name, endpoint.port.empty() ? "domain" : endpoint.port);
-  boost::asio::ip::tcp::resolver::iterator endpoint_iterator =
-    resolver.resolve(query);
-  boost::asio::ip::tcp::resolver::iterator end;
+    endpoint.name, endpoint.port.empty() ? default_port : endpoint.port);
+  pending_++;
+  resolver_.async_resolve(query,
+    boost::bind(
+      &client::on_resolve,
+      this,
+      boost::asio::placeholders::error,
+      boost::asio::placeholders::results
+    )
+  );
+#endif
+}
 
-  if (boost::asio::connect(socket_, endpoint_iterator) == end) {
-    LOG(ERR) << "Could not connect\n";
-    this->reset();
+void client::on_resolve(const boost::system::error_code& error,
+  boost::asio::ip::tcp::resolver::results_type results)
+{
+  pending_--;
+  if (!connecting_) {
+    this->release();
+    return;
+  }
+  if (error) {
+    LOG(ERR) << "Could not resolve the upstream: " << error.message() << '\n';
+    this->connect_failed();
+    return;
+  }
+  for (auto const& entry : results)
+    endpoints_.push_back(entry.endpoint());
+  this->connect_next();
+}
+
+void client::connect_next()
+{
+  while (next_endpoint_ < endpoints_.size()) {
+    boost::asio::ip::tcp::endpoint const& endpoint =
+      endpoints_[next_endpoint_++];
+    boost::system::error_code ec;
+    socket_.close(ec);
+    socket_.open(endpoint.protocol(), ec);
+    if (ec)
+      continue;
+#ifdef HAVE_TCP_FASTOPEN_CONNECT
+    // The first request is sent with the SYN when a cookie is available:
+    if (service_->config().tcp_fastopen) {
+      int enable = 1;
+      setsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+        &enable, sizeof(enable));
+    }
+#endif
+    pending_++;
+    socket_.async_connect(endpoint,
+      boost::bind(
+        &client::on_connect,
+        this,
+        boost::asio::placeholders::error
+      )
+    );
     return;
   }
+  this->connect_failed();
+}
 
+void client::on_connect(const boost::system::error_code& error)
+{
+  pending_--;
+  if (!connecting_) {
+    this->release();
+    return;
+  }
+  if (error) {
+    LOG(DEBUG) << "Connection error: " << error << '\n';
+    this->connect_next();
+    return;
+  }
+  connecting_ = false;
+  connect_timer_.cancel();
+  this->on_connected();
+}
+
+// Abort the connection attempt: its operation completes with an error.
+void client::on_connect_timer(const boost::system::error_code& error)
+{
+  pending_--;
+  if (!connecting_) {
+    this->release();
+    return;
+  }
+  if (error)
+    return;
+  LOG(WARNING) << "Connection timed out\n";
+  next_endpoint_ = endpoints_.size();
+  resolver_.cancel();
+  boost::system::error_code ec;
+  socket_.close(ec);
+}
+
+// Only the failures of the active connection count for the circuit breaker:
+// a failed standby connection is not replaced until the next one is used.
+void client::connect_failed()
+{
+  LOG(ERR) << "Could not connect\n";
+  bool active = this->active();
+  this->reset();
+  if (active)
+    service_->upstream_failed(*upstream_);
+}
+
+void client::on_connected()
+{
   LOG(DEBUG) << "Connected\n";
 
+  dnsfwd::config const& config = service_->config();
+  boost::system::error_code ec;
   boost::asio::ip::tcp::no_delay no_delay(true);
-  socket_.set_option(no_delay);
+  socket_.set_option(no_delay, ec);
+
+  // Detect dead connections (in particular the standby ones):
+  if (config.keepalive) {
+    socket_.set_option(boost::asio::socket_base::keep_alive(true), ec);
+#ifdef HAVE_TCP_KEEPIDLE
+    int fd = socket_.native_handle();
+    int idle = config.keepalive;
+    int count = 3;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+  }
 
+  // The connections replacing a failed one are checked at once:
+  if (config.health_interval) {
+    if (upstream_->down || upstream_->failures)
+      this->probe();
+    else
+      this->wait_probe(std::chrono::seconds(config.health_interval));
+  }
+  this->start();
+}
+
+void client::start()
+{
   this->start_receive();
   this->send();
 }
 
 void client::send()
 {
+  if (sending_ != 0 || connecting_)
+    return;
+  if (probe_queued_ && socket_.is_open()) {
+    probe_queued_ = false;
+    sending_ = sizeof(PROBE_QUERY);
+    LOG(DEBUG) << "Sending health check\n";
+    pending_++;
+    boost::asio::async_write(
+      socket_,
+      boost::asio::buffer(PROBE_QUERY),
+      make_allocated_handler(write_memory_,
+        boost::bind(
+          &client::on_send,
+          this,
+          boost::asio::placeholders::error,
+          boost::asio::placeholders::bytes_transferred
+        )
+      )
+    );
+    return;
+  }
+  this->clear(message_clock() - service_->time_to_live().count() * 1000);
+  if (!this->admitted())
+    return;
   if (!context_) {
-    context_ = service_->unqueue();
+    if (!this->active())
+      return;
+    context_ = service_->unqueue(*upstream_);
     if (!context_)
       return;
   }
@@ -134,145 +352,313 @@ void client::send()
     return;
   }
 
-  this->clear(std::chrono::steady_clock::now() - service_->time_to_live());
+  context_->mark(&query_trace::dequeued);
 
   // Choose a client ID:
   context_->client_id_ = this->random_client_id();
   context_->id(context_->client_id_);
 
+  // The request is registered before being written as the reply may be
+  // read before the write completion is handled:
+  context_->timestamp_ = message_clock();
+  this->by_client_id_.insert(*context_);
+  this->queue_.push_back(*context_);
+  message& request = *context_.release();
+  sending_ = request.size() + sizeof(uint16_t);
+  if (request.trace())
+    traced_writes_.push_back(request.client_id_);
+
   LOG(DEBUG) << "Forwarding request\n";
+  PROBE3(query__forwarded, &request, ntohs(request.client_id_), request.size());
+  pending_++;
   boost::asio::async_write(
     socket_,
-    context_->vc_buffer(),
-    boost::bind(
-      &client::on_send,
-      this->shared_from_this(),
-      boost::asio::placeholders::error,
-      boost::asio::placeholders::bytes_transferred
+    request.vc_buffer(),
+    make_allocated_handler(write_memory_,
+      boost::bind(
+        &client::on_send,
+        this,
+        boost::asio::placeholders::error,
+        boost::asio::placeholders::bytes_transferred
+      )
     )
   );
 }
 
 void client::on_send(const boost::system::error_code& error, std::size_t bytes_transferred)
 {
+  std::size_t expected = sending_;
+  sending_ = 0;
+  pending_--;
+  if (!socket_.is_open()) {
+    this->release();
+    return;
+  }
+
   if (error) {
     LOG(ERR) << "Forward request: error " << error << '\n';
     this->reset();
     return;
   }
 
-  if (bytes_transferred != context_->size_ + sizeof(uint16_t)) {
+  if (bytes_transferred != expected) {
     LOG(ERR) << "Forward request: transfer incomplete\n";
     this->reset();
     return;
   }
 
   LOG(DEBUG) << "Request forwarded\n";
-  context_->timestamp_ = std::chrono::steady_clock::now();
-  this->by_client_id_.insert(*context_);
-  this->queue_.push_back(*context_);
-  context_.release();
-
+  this->on_written();
   this->send();
 }
 
 void client::start_receive()
 {
-  boost::asio::async_read(
-    socket_,
-    boost::asio::buffer(&response_size_, sizeof(response_size_)),
-    boost::bind(
-      &client::on_message_size,
-      this->shared_from_this(),
-      boost::asio::placeholders::error,
-      boost::asio::placeholders::bytes_transferred
+  // Move the partial message at the beginning of the buffer:
+  if (input_start_ != 0) {
+    std::memmove(input_.data(), input_.data() + input_start_,
+      input_end_ - input_start_);
+    input_end_ -= input_start_;
+    input_start_ = 0;
+  }
+  pending_++;
+  socket_.async_read_some(
+    boost::asio::buffer(input_.data() + input_end_, input_.size() - input_end_),
+    make_allocated_handler(read_memory_,
+      boost::bind(
+        &client::on_read,
+        this,
+        boost::asio::placeholders::error,
+        boost::asio::placeholders::bytes_transferred
+      )
     )
   );
 }
 
-void client::on_message_size(const boost::system::error_code& error, std::size_t size)
+void client::on_read(const boost::system::error_code& error, std::size_t size)
 {
-  if (error) {
-    LOG(DEBUG) << "Reply reception error: " << error << '\n';
-    this->reset();
+  pending_--;
+  if (!socket_.is_open()) {
+    this->release();
     return;
   }
-
-  if (size != sizeof(uint16_t)) {
-    LOG(ERR) << "Reply reception incomplete\n";
+  if (error) {
+    LOG(DEBUG) << "Reply reception error: " << error << '\n';
     this->reset();
     return;
   }
 
-  LOG(DEBUG) << "Reply size received\n";
-  this->response_size_ = ntohs(this->response_size_);
-  buffer_.resize(this->response_size_);
-  boost::asio::async_read(
-    socket_,
-    boost::asio::buffer(buffer_.data(), this->response_size_),
-    boost::bind(
-      &client::on_message,
-      this->shared_from_this(),
-      boost::asio::placeholders::error,
-      boost::asio::placeholders::bytes_transferred
-    )
-  );
+  input_end_ += size;
+  input_start_ += this->on_input(
+    input_.data() + input_start_, input_end_ - input_start_);
+  if (socket_.is_open())
+    this->start_receive();
 }
 
-void client::on_message(const boost::system::error_code& error, std::size_t size)
+// Handle all the complete messages received and return the number of bytes
+// consumed:
+std::size_t client::on_input(const char* data, std::size_t size)
 {
-  if (error) {
-    LOG(ERR) << "Reply reception error: " << error << '\n';
-    this->reset();
-    return;
-  }
-
-  if (size != this->response_size_) {
-    LOG(ERR) << "Reply reception incomplete\n";
-    this->reset();
-    return;
+  std::size_t consumed = 0;
+  while (size - consumed >= sizeof(std::uint16_t)) {
+    const unsigned char* p = (const unsigned char*) data + consumed;
+    std::size_t length = (p[0] << 8) | p[1];
+    if (size - consumed < sizeof(std::uint16_t) + length)
+      break;
+    this->on_reply(data + consumed + sizeof(std::uint16_t), length);
+    consumed += sizeof(std::uint16_t) + length;
   }
+  return consumed;
+}
 
+// Forward a reply to the client of the original request:
+void client::on_reply(const char* data, std::size_t size)
+{
   if (size < MIN_MESSAGE_SIZE) {
     LOG(ERR) << "Reply received but too small\n";
-    this->start_receive();
     return;
   }
 
   // Find the original request based on message ID:
   std::uint16_t client_id;
-  std::memcpy(&client_id, buffer_.data(), sizeof(client_id));
+  std::memcpy(&client_id, data, sizeof(client_id));
+  if (client_id == PROBE_ID && probing_) {
+    this->on_probe_reply(data, size);
+    return;
+  }
   by_client_id_type::iterator i = by_client_id_.find(client_id,
     order_message_by_client_id());
   by_client_id_type::iterator end = by_client_id_.end();
   if (i == end) {
     LOG(ERR) << "Reply received not expected\n";
-    this->start_receive();
     return;
   }
-  LOG(DEBUG) << "Reply received\n";
   message& c = *i;
   assert(c.client_id_ == client_id);
 
-  std::memcpy(buffer_.data(), &c.server_id_, sizeof(c.server_id_));
-  c.server_->send_response(std::move(buffer_), c.endpoint_);
+  // Reject spoofed or mismatched replies:
+  message_view response;
+  message_view request;
+  if (!response.parse(data, size) || !response.qr()) {
+    LOG(ERR) << "Reply received is not a valid response\n";
+    return;
+  }
+  if (!request.parse(c.data(), c.size())
+      || !same_question(request, response)) {
+    LOG(ERR) << "Reply received does not match the request\n";
+    return;
+  }
+  LOG(DEBUG) << "Reply received\n";
+  PROBE3(reply__matched, &c, ntohs(client_id), size);
+
+  c.mark(&query_trace::replied);
+  if (size > MAX_UDP_RESPONSE_SIZE && size > udp_response_size(request)) {
+    LOG(DEBUG) << "Reply truncated\n";
+    char truncated[MAX_QUERY_SIZE];
+    std::memcpy(truncated, data, response.question_end());
+    size = truncated_response(truncated, response);
+    c.server().send_response(c, truncated, size);
+  } else {
+    c.server().send_response(c, data, size);
+  }
+  if (query_trace* trace = c.trace()) {
+    c.mark(&query_trace::sent);
+    // The reply may be handled before the write completion:
+    if (trace->written == clock_type::time_point())
+      trace->written = trace->replied;
+    service_->trace(c);
+  }
 
   // Forget about it:
   by_client_id_.erase(i);
   queue_.erase_and_dispose(queue_.iterator_to(c), deleter());
 
-  this->start_receive();
+  // Slow start after a recovery:
+  if (upstream_->admitted && ++upstream_->admitted > MAX_RECOVERY_ADMISSION) {
+    LOG(INFO) << "Upstream fully admitted\n";
+    upstream_->admitted = 0;
+  }
+  // A request may be waiting for a free slot:
+  if (upstream_->admitted || service_->config().max_inflight)
+    this->send();
+}
+
+// Whether another request may be sent: the requests in flight are limited
+// by the configuration and while the upstream recovers.
+bool client::admitted() const
+{
+  if (by_client_id_.size() >= MAX_CONNECTION_REQUESTS)
+    return false;
+  std::size_t limit = service_->config().max_inflight;
+  if (upstream_->admitted && (!limit || upstream_->admitted < limit))
+    limit = upstream_->admitted;
+  return limit == 0 || by_client_id_.size() < limit;
 }
 
 void client::reset()
 {
   if (socket_.is_open()) {
+    PROBE2(connection__reset, this, by_client_id_.size());
     boost::system::error_code ec;
     socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
     // Ignore errors from shutdown().
     socket_.close();
   }
+  probe_timer_.cancel();
+  resolver_.cancel();
+  connect_timer_.cancel();
   service_->unregister(this->shared_from_this());
+  connecting_ = false;
+  this->release();
+}
+
+// Send a health check query and wait for its reply:
+void client::probe()
+{
+  probe_queued_ = true;
+  probing_ = true;
+  this->wait_probe(
+    std::chrono::milliseconds(service_->config().health_timeout));
+}
+
+void client::wait_probe(clock_type::duration delay)
+{
+  pending_++;
+  probe_timer_.expires_from_now(delay);
+  probe_timer_.async_wait(
+    boost::bind(
+      &client::on_probe_timer,
+      this,
+      boost::asio::placeholders::error
+    )
+  );
+}
+
+void client::on_probe_timer(const boost::system::error_code& error)
+{
+  pending_--;
+  if (!socket_.is_open()) {
+    this->release();
+    return;
+  }
+  if (error)
+    return;
+  if (probing_) {
+    LOG(WARNING) << "Health check timed out\n";
+    this->fail_requests();
+    service_->upstream_failed(*upstream_);
+    this->reset();
+    return;
+  }
+  // The health checks may have been disabled by a reload:
+  if (!service_->config().health_interval)
+    return;
+  this->probe();
+  this->send();
+}
+
+void client::on_probe_reply(const char* data, std::size_t size)
+{
+  message_view response;
+  if (!response.parse(data, size) || !response.qr() || response.rcode() != 0
+      || response.qtype() != 2 || response.qname_size() != 1) {
+    LOG(ERR) << "Invalid health check reply\n";
+    this->fail_requests();
+    service_->upstream_failed(*upstream_);
+    this->reset();
+    return;
+  }
+  LOG(DEBUG) << "Health check succeeded\n";
+  probing_ = false;
+  if (service_->config().health_interval)
+    this->wait_probe(
+      std::chrono::seconds(service_->config().health_interval));
+  else
+    probe_timer_.cancel();
+  service_->upstream_healthy(*upstream_);
+  this->send();
+}
+
+// Record the write completion of the sampled requests:
+void client::on_written()
+{
+  for (std::uint16_t client_id : traced_writes_) {
+    auto i = by_client_id_.find(client_id, order_message_by_client_id());
+    if (i != by_client_id_.end())
+      i->mark(&query_trace::written);
+  }
+  traced_writes_.clear();
+}
+
+// Drop the reference of the client to itself once it is closed and its
+// operations have completed. This may be called from a member function so
+// the client is destroyed later from the io_service:
+void client::release()
+{
+  if (pending_ != 0 || !self_ || socket_.is_open())
+    return;
+  std::shared_ptr<client> self = std::move(self_);
+  io_service_->post([self]() {});
 }
 
 }
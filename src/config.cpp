@@ -25,8 +25,13 @@ THE SOFTWARE.
 
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
+#include <fstream>
 #include <regex>
+#include <stdexcept>
 
 #ifdef USE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -112,6 +117,12 @@ const char** logformat = kernel_logformat;
 
 namespace {
 
+// Invalid configuration: fatal on startup, ignored on reload.
+class config_error : public std::runtime_error {
+public:
+  explicit config_error(std::string const& what) : std::runtime_error(what) {}
+};
+
 endpoint parse_endpoint(std::string const& e)
 {
 
@@ -132,11 +143,79 @@ endpoint parse_endpoint(std::string const& e)
       res.port = match[2];
     return res;
   } else {
-    LOG(ERR) << "Invalid endpoint specification\n";
-    std::exit(1);
+    throw config_error("Invalid endpoint specification");
   }
 }
 
+// Parse a DNS over HTTPS endpoint such as "192.0.2.1:443/dns-query":
+endpoint parse_http_endpoint(std::string const& e)
+{
+  std::size_t pos = e.find('/');
+  endpoint res = parse_endpoint(e.substr(0, pos));
+  res.path = pos == std::string::npos ? "/dns-query" : e.substr(pos);
+  return res;
+}
+
+// Parse a route such as "corp.example=192.0.2.1:53":
+void add_route(dnsfwd::config& config, std::string const& e)
+{
+  std::size_t pos = e.find('=');
+  if (pos == std::string::npos || pos == 0)
+    throw config_error("Invalid route specification");
+  std::string domain = e.substr(0, pos);
+  if (domain.back() == '.')
+    domain.pop_back();
+  std::string wire;
+  if (!wire_name(domain, wire))
+    throw config_error("Invalid domain name " + domain);
+  std::string upstream = e.substr(pos + 1);
+  endpoint endpoint = upstream.find('/') == std::string::npos
+    ? parse_endpoint(upstream) : parse_http_endpoint(upstream);
+  for (route& route : config.routes)
+    if (same_domain(route.domain, domain)) {
+      route.connect_tcp.push_back(endpoint);
+      return;
+    }
+  config.routes.push_back(route());
+  config.routes.back().domain = domain;
+  config.routes.back().connect_tcp.push_back(endpoint);
+}
+
+// CPUs which can be put in an affinity mask:
+#ifdef HAVE_SCHED_SETAFFINITY
+const int MAX_CPUS = CPU_SETSIZE;
+#else
+const int MAX_CPUS = 1024;
+#endif
+
+// Parse a CPU list such as "0-3,8":
+std::vector<int> parse_cpus(std::string const& e)
+{
+  std::vector<int> res;
+  std::regex range("^([0-9]{1,9})(-([0-9]{1,9}))?$");
+  std::smatch match;
+  std::size_t start = 0;
+  while (start <= e.size()) {
+    std::size_t end = e.find(',', start);
+    if (end == std::string::npos)
+      end = e.size();
+    std::string item = e.substr(start, end - start);
+    if (!std::regex_match(item, match, range)) {
+      throw config_error("Invalid CPU list");
+    }
+    int first = std::stoi(match[1]);
+    int last = match[3].matched ? std::stoi(match[3]) : first;
+    if (first > last)
+      throw config_error("Invalid CPU range " + item);
+    if (last >= MAX_CPUS)
+      throw config_error("CPU " + std::to_string(last) + " out of range");
+    for (int cpu = first; cpu <= last; ++cpu)
+      res.push_back(cpu);
+    start = end + 1;
+  }
+  return res;
+}
+
 }
 
 boost::asio::ip::udp::endpoint endpoint::udp_endpoint(
@@ -151,72 +230,226 @@ boost::asio::ip::udp::endpoint endpoint::udp_endpoint(
   return *endpoint_iterator;
 }
 
-void setup_config(dnsfwd::config& config, int argc, char** argv)
+namespace {
+
+boost::program_options::options_description options()
 {
   using boost::program_options::options_description;
   using boost::program_options::value;
-  using boost::program_options::variables_map;
-  using boost::program_options::store;
-  using boost::program_options::option;
-  using boost::program_options::notify;
-  using boost::program_options::parse_command_line;
-  using boost::program_options::command_line_parser;
-  using boost::program_options::positional_options_description;
 
   options_description desc("Allowed options");
   desc.add_options()
     ("help", "help")
+    ("config", value<std::string>(), "read the options from the given file (reloaded on SIGHUP)")
     ("bind-udp", value<std::vector<std::string>>(), "bind to the given UDP address (eg. 127.0.0.1:43)")
     ("connect-tcp", value<std::vector<std::string>>(), "connect to the given TCP endpoint (eg. 127.0.0.1:43)")
+    ("connect-doh", value<std::vector<std::string>>(), "connect to the given DNS over HTTPS endpoint (eg. 127.0.0.1:8443/dns-query)")
+    ("standby-connections", value<std::size_t>(), "number of idle connections kept ready for each upstream")
+    ("max-inflight", value<std::size_t>(), "maximum number of requests in flight on an upstream connection (0 for no limit)")
+    ("flow-queue", value<std::size_t>(), "maximum number of queued requests of a client for each upstream (0 for no limit)")
+    ("keepalive", value<int>(), "TCP keepalive idle time and interval in seconds (0 to disable)")
+    ("tcp-fastopen", "use TCP Fast Open for the upstream connections")
+    ("health-interval", value<int>(), "send a health check query on the upstream connections every given seconds (0 to disable)")
+    ("health-timeout", value<int>(), "health check timeout in milliseconds")
+    ("trace-slow", value<std::size_t>(), "keep the stages of the given number of slowest queries (dumped on SIGUSR1)")
+    ("trace-sample", value<std::size_t>(), "trace one query out of the given number")
+    ("route", value<std::vector<std::string>>(), "forward the queries under a domain to another endpoint (eg. corp.example=192.0.2.1:53 or corp.example=192.0.2.1:443/dns-query)")
+    ("blocklist", value<std::string>(), "answer locally the queries for the names in a compiled blocklist")
+    ("blocklist-answer", value<std::string>(), "answer for blocked names (nxdomain, null)")
+    ("cpu-affinity", value<std::string>(), "run on the given CPUs (eg. 0-3,8)")
     ("loglevel", value<int>(), "loglevel (0--8)")
     ("logformat", value<std::string>(), "logformat (kernel, daemon, human)")
     ;
+  return desc;
+}
+
+// The options of the command line take precedence over the ones of the
+// configuration file:
+boost::program_options::variables_map parse_options(
+  std::vector<std::string> const& args,
+  boost::program_options::options_description const& desc)
+{
+  using boost::program_options::variables_map;
+  using boost::program_options::store;
+  using boost::program_options::notify;
+  using boost::program_options::command_line_parser;
+  using boost::program_options::parse_config_file;
+
+  std::vector<std::string> arguments;
+  if (!args.empty())
+    arguments.assign(args.begin() + 1, args.end());
 
   variables_map vm;
-  store(command_line_parser(argc, argv).options(desc).run(), vm);
+  store(command_line_parser(arguments).options(desc).run(), vm);
+  if (vm.count("config")) {
+    std::string path = vm["config"].as<std::string>();
+    std::ifstream file(path.c_str());
+    if (!file)
+      throw config_error("Could not read " + path);
+    store(parse_config_file(file, desc), vm);
+  }
   notify(vm);
+  return vm;
+}
 
-  if (vm.count("help")) {
-    std::cout << "dnsfwd: DNS forwarder over a (TCP) virtual circuit\n";
-    std::cout << desc << "\n";
-    std::exit(0);
+void apply_options(dnsfwd::config& config,
+  boost::program_options::variables_map const& vm)
+{
+  if (vm.count("bind-udp"))
+    for (std::string const& e : vm["bind-udp"].as<std::vector<std::string>>())
+      config.bind_udp.push_back(parse_endpoint(e));
+  if (vm.count("connect-tcp"))
+    for (std::string const& e : vm["connect-tcp"].as<std::vector<std::string>>())
+      config.connect_tcp.push_back(parse_endpoint(e));
+  if (vm.count("connect-doh"))
+    for (std::string const& e : vm["connect-doh"].as<std::vector<std::string>>())
+      config.connect_tcp.push_back(parse_http_endpoint(e));
+  if (config.connect_tcp.empty())
+    throw config_error("connect-tcp or connect-doh is required");
+  if (vm.count("route"))
+    for (std::string const& e : vm["route"].as<std::vector<std::string>>())
+      add_route(config, e);
+  if (vm.count("blocklist"))
+    config.blocklist = vm["blocklist"].as<std::string>();
+  if (vm.count("blocklist-answer")) {
+    std::string answer = vm["blocklist-answer"].as<std::string>();
+    if (answer == "nxdomain") {
+      config.blocklist_null = false;
+    } else if (answer == "null") {
+      config.blocklist_null = true;
+    } else {
+      throw config_error("unexpected blocklist answer");
+    }
   }
+  if (vm.count("standby-connections"))
+    config.standby = vm["standby-connections"].as<std::size_t>();
+  if (vm.count("max-inflight"))
+    config.max_inflight = vm["max-inflight"].as<std::size_t>();
+  if (vm.count("flow-queue"))
+    config.flow_queue = vm["flow-queue"].as<std::size_t>();
+  if (vm.count("keepalive")) {
+    config.keepalive = vm["keepalive"].as<int>();
+    if (config.keepalive < 0)
+      throw config_error("unexpected keepalive");
+  }
+  if (vm.count("tcp-fastopen"))
+    config.tcp_fastopen = true;
+  if (vm.count("health-interval")) {
+    config.health_interval = vm["health-interval"].as<int>();
+    if (config.health_interval < 0)
+      throw config_error("unexpected health interval");
+  }
+  if (vm.count("health-timeout")) {
+    config.health_timeout = vm["health-timeout"].as<int>();
+    if (config.health_timeout <= 0)
+      throw config_error("unexpected health timeout");
+  }
+  if (vm.count("trace-slow"))
+    config.trace_slow = vm["trace-slow"].as<std::size_t>();
+  if (vm.count("trace-sample")) {
+    config.trace_sample = vm["trace-sample"].as<std::size_t>();
+    if (config.trace_sample == 0)
+      throw config_error("unexpected trace sample");
+  }
+  if (vm.count("cpu-affinity"))
+    config.cpus = parse_cpus(vm["cpu-affinity"].as<std::string>());
 
+  const char** format = logformat;
   if (vm.count("logformat")) {
-    std::string format = vm["logformat"].as<std::string>();
-    if (format == "kernel") {
-      logformat = kernel_logformat;
-    } else if (format == "daemon") {
-      logformat = daemon_logformat;
-    } else if (format == "human") {
-      logformat = human_logformat;
+    std::string name = vm["logformat"].as<std::string>();
+    if (name == "kernel") {
+      format = kernel_logformat;
+    } else if (name == "daemon") {
+      format = daemon_logformat;
+    } else if (name == "human") {
+      format = human_logformat;
     } else {
-      LOG(ERR) << "unexpected log format\n";
-      std::exit(1);
+      throw config_error("unexpected log format");
     }
   }
 
+  int level = ::dnsfwd::loglevel;
   if (vm.count("loglevel")) {
-    int loglevel = vm["loglevel"].as<int>();
-    if (loglevel < 0 || loglevel > 8) {
-      LOG(ERR) << "unexpected loglevel\n";
-      std::exit(1);
-    }
-    ::dnsfwd::loglevel = loglevel;
+    level = vm["loglevel"].as<int>();
+    if (level < 0 || level > 8)
+      throw config_error("unexpected loglevel");
   }
 
-  if (vm.count("bind-udp"))
-    for (std::string const& e : vm["bind-udp"].as<std::vector<std::string>>())
-      config.bind_udp.push_back(parse_endpoint(e));
-  if (vm.count("connect-tcp"))
-    for (std::string const& e : vm["connect-tcp"].as<std::vector<std::string>>())
-      config.connect_tcp.push_back(parse_endpoint(e));
+  // Only once the configuration is known to be valid:
+  logformat = format;
+  ::dnsfwd::loglevel = level;
+}
 
-    if (!config.listen_fds) {
-      config.listen_fds = sd_listen_fds(1);
-      if (config.listen_fds < 0)
-        config.listen_fds = 0;
+}
+
+void setup_config(dnsfwd::config& config, int argc, char** argv)
+{
+  boost::program_options::options_description desc = options();
+  config.args.assign(argv, argv + argc);
+
+  try {
+    boost::program_options::variables_map vm = parse_options(config.args, desc);
+    if (vm.count("help")) {
+      std::cout << "dnsfwd: DNS forwarder over a (TCP) virtual circuit\n";
+      std::cout << desc << "\n";
+      std::exit(0);
     }
+    apply_options(config, vm);
+  }
+  catch (config_error& e) {
+    LOG(ERR) << e.what() << "\n";
+    std::exit(1);
+  }
+
+  if (!config.listen_fds) {
+    config.listen_fds = sd_listen_fds(1);
+    if (config.listen_fds < 0)
+      config.listen_fds = 0;
+  }
+
+  // The UDP sockets were handed off by the previous process and are
+  // already bound:
+  if (std::getenv("DNSFWD_HANDOFF") != nullptr) {
+    unsetenv("DNSFWD_HANDOFF");
+    config.bind_udp.clear();
+  }
+}
+
+// Parse again the command line and the configuration file. The current
+// configuration is kept if the new one is not valid:
+bool reload_config(dnsfwd::config& config)
+{
+  dnsfwd::config res;
+  res.args = config.args;
+  res.listen_fds = config.listen_fds;
+  try {
+    apply_options(res, parse_options(res.args, options()));
+  }
+  catch (std::exception& e) {
+    LOG(ERR) << "Configuration not reloaded: " << e.what() << "\n";
+    return false;
+  }
+  config = std::move(res);
+  return true;
+}
+
+void setup_affinity(dnsfwd::config const& config)
+{
+  if (config.cpus.empty())
+    return;
+#ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : config.cpus)
+    CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    LOG(ERR) << "Could not set CPU affinity\n";
+    std::exit(1);
+  }
+  LOG(DEBUG) << "Running on " << CPU_COUNT(&set) << " CPU(s)\n";
+#else
+  LOG(WARNING) << "CPU affinity not supported\n";
+#endif
 }
 
 }
@@ -0,0 +1,296 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace dnsfwd {
+
+namespace {
+
+std::uint16_t read_u16(const unsigned char* p)
+{
+  return (std::uint16_t) ((p[0] << 8) | p[1]);
+}
+
+std::uint64_t load_u64(const char* p)
+{
+  std::uint64_t res;
+  std::memcpy(&res, p, sizeof(res));
+  return res;
+}
+
+// Map the ASCII uppercase letters of 8 bytes to lowercase at once.
+// Label length bytes are below 64 and are left unchanged.
+std::uint64_t fold_u64(std::uint64_t x)
+{
+  const std::uint64_t ones = 0x0101010101010101ull;
+  const std::uint64_t high = 0x8080808080808080ull;
+  std::uint64_t low = x & ~high;
+  std::uint64_t above_a = low + (0x80 - 'A') * ones;
+  std::uint64_t above_z = low + (0x80 - 'Z' - 1) * ones;
+  std::uint64_t upper = above_a & ~above_z & ~x & high;
+  return x | (upper >> 2);
+}
+
+char fold_char(char c)
+{
+  return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+}
+
+// Add a (wire format) label to the hash of a name ignoring the ASCII case.
+// Names are hashed label by label starting from the root.
+std::uint64_t hash_label(std::uint64_t hash, const char* label)
+{
+  std::size_t size = (std::uint8_t) label[0] + 1;
+  for (std::size_t i = 0; i != size; ++i) {
+    hash ^= (std::uint8_t) fold_char(label[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Hash of a wire format name (without the root label):
+std::uint64_t hash_name(const char* name, std::size_t size)
+{
+  const char* labels[MAX_LABELS];
+  std::size_t count = 0;
+  for (std::size_t pos = 0; pos < size && count != MAX_LABELS;
+      pos += (std::uint8_t) name[pos] + 1)
+    labels[count++] = name + pos;
+  std::uint64_t hash = NAME_HASH_SEED;
+  for (std::size_t i = count; i != 0; --i)
+    hash = hash_label(hash, labels[i - 1]);
+  return hash;
+}
+
+// Convert a dotted name to the lowercase wire format without the root label:
+bool wire_name(std::string const& name, std::string& res)
+{
+  res.clear();
+  std::size_t start = 0;
+  while (start < name.size()) {
+    std::size_t end = name.find('.', start);
+    if (end == std::string::npos)
+      end = name.size();
+    std::size_t len = end - start;
+    if (len == 0 || len > 63)
+      return false;
+    res.push_back((char) len);
+    for (std::size_t i = start; i != end; ++i)
+      res.push_back(fold_char(name[i]));
+    start = end + 1;
+  }
+  return !res.empty() && res.size() < MAX_NAME_SIZE;
+}
+
+// Whether two dotted names are the same domain (ignoring the case):
+bool same_domain(std::string const& a, std::string const& b)
+{
+  std::string wire_a;
+  std::string wire_b;
+  return wire_name(a, wire_a) && wire_name(b, wire_b) && wire_a == wire_b;
+}
+
+// Presentation format of a wire format name:
+std::string text_name(const char* name, std::size_t size)
+{
+  std::string res;
+  std::size_t i = 0;
+  while (i < size && name[i] != 0) {
+    std::size_t length = (unsigned char) name[i++];
+    for (std::size_t j = 0; j < length && i < size; ++j, ++i) {
+      unsigned char c = name[i];
+      if (c == '.' || c == '\\') {
+        res += '\\';
+        res += c;
+      } else if (c > 0x20 && c < 0x7F) {
+        res += c;
+      } else {
+        char escape[5];
+        std::snprintf(escape, sizeof(escape), "\\%03u", c);
+        res += escape;
+      }
+    }
+    res += '.';
+  }
+  return res.empty() ? "." : res;
+}
+
+// Compare two wire format names of the given size ignoring the ASCII case:
+bool same_name(const char* a, const char* b, std::size_t size)
+{
+  std::size_t i = 0;
+  for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t))
+    if (fold_u64(load_u64(a + i)) != fold_u64(load_u64(b + i)))
+      return false;
+  for (; i < size; ++i)
+    if (fold_char(a[i]) != fold_char(b[i]))
+      return false;
+  return true;
+}
+
+bool message_view::parse(const char* data, std::size_t size)
+{
+  data_ = data;
+  size_ = size;
+  qname_ = nullptr;
+  qname_size_ = 0;
+  qtype_ = 0;
+  qclass_ = 0;
+  edns_ = false;
+  if (size < MIN_MESSAGE_SIZE)
+    return false;
+
+  const unsigned char* p = (const unsigned char*) data;
+  flags_ = read_u16(p + 2);
+  qdcount_ = read_u16(p + 4);
+  ancount_ = read_u16(p + 6);
+  nscount_ = read_u16(p + 8);
+  arcount_ = read_u16(p + 10);
+  question_end_ = MIN_MESSAGE_SIZE;
+  if (qdcount_ == 0)
+    return true;
+  if (qdcount_ != 1)
+    return false;
+
+  // The question name comes first and is never compressed:
+  std::size_t pos = MIN_MESSAGE_SIZE;
+  while (1) {
+    if (pos >= size)
+      return false;
+    std::size_t len = p[pos];
+    if (len & 0xC0)
+      return false;
+    pos += len + 1;
+    if (pos - MIN_MESSAGE_SIZE > MAX_NAME_SIZE)
+      return false;
+    if (len == 0)
+      break;
+  }
+  if (pos + 4 > size)
+    return false;
+  qname_ = data + MIN_MESSAGE_SIZE;
+  qname_size_ = pos - MIN_MESSAGE_SIZE;
+  qtype_ = read_u16(p + pos);
+  qclass_ = read_u16(p + pos + 2);
+  question_end_ = pos + 4;
+  return true;
+}
+
+// Skip a possibly compressed name:
+std::size_t message_view::skip_name(std::size_t pos) const
+{
+  const unsigned char* p = (const unsigned char*) data_;
+  while (pos < size_) {
+    std::size_t len = p[pos];
+    if ((len & 0xC0) == 0xC0)
+      return pos + 2 <= size_ ? pos + 2 : 0;
+    if (len & 0xC0)
+      return 0;
+    pos += len + 1;
+    if (len == 0)
+      return pos;
+  }
+  return 0;
+}
+
+// Look for the EDNS OPT record in the additional section:
+bool message_view::parse_edns()
+{
+  const unsigned char* p = (const unsigned char*) data_;
+  std::size_t pos = question_end_;
+  unsigned count = ancount_ + nscount_ + arcount_;
+  for (unsigned i = 0; i != count; ++i) {
+    std::size_t name = pos;
+    pos = this->skip_name(pos);
+    if (pos == 0 || pos + 10 > size_)
+      return false;
+    std::uint16_t type = read_u16(p + pos);
+    std::size_t rdlength = read_u16(p + pos + 8);
+    if (i >= ancount_ + nscount_ && type == TYPE_OPT) {
+      if (p[name] != 0)
+        return false;
+      edns_ = true;
+      udp_payload_size_ = read_u16(p + pos + 2);
+      edns_ttl_ = ((std::uint32_t) read_u16(p + pos + 4) << 16)
+        | read_u16(p + pos + 6);
+    }
+    pos += 10 + rdlength;
+    if (pos > size_)
+      return false;
+  }
+  return true;
+}
+
+// Check that a reply is an answer to the given request. An error reply
+// (FORMERR, NOTIMP, REFUSED...) may have no question:
+bool same_question(message_view const& request, message_view const& reply)
+{
+  if (reply.qdcount() == 0 && reply.rcode() != 0)
+    return true;
+  return request.qdcount() == reply.qdcount()
+    && request.qtype() == reply.qtype()
+    && request.qclass() == reply.qclass()
+    && request.qname_size() == reply.qname_size()
+    && same_name(request.qname(), reply.qname(), request.qname_size());
+}
+
+// Turn the request (copied in the buffer up to the end of the question) into
+// an answerless response with the given response code:
+std::size_t error_response(
+  char* buffer, message_view const& request, unsigned rcode)
+{
+  // QR, opcode and RD from the request, RA:
+  buffer[2] = (char) (0x80 | (buffer[2] & 0x79));
+  buffer[3] = (char) (0x80 | rcode);
+  std::memset(buffer + 6, 0, 6);
+  return request.question_end();
+}
+
+// Largest response the client accepts over UDP (as announced in its EDNS OPT
+// record):
+std::size_t udp_response_size(message_view& request)
+{
+  if (!request.parse_edns() || !request.edns())
+    return MAX_UDP_RESPONSE_SIZE;
+  return std::max<std::size_t>(request.udp_payload_size(), MAX_UDP_RESPONSE_SIZE);
+}
+
+// Turn the response (copied in the buffer up to the end of the question) into
+// an empty truncated response: the client retries over TCP.
+std::size_t truncated_response(char* buffer, message_view const& response)
+{
+  buffer[2] = (char) (buffer[2] | 0x02);
+  std::memset(buffer + 6, 0, 6);
+  return response.question_end();
+}
+
+}
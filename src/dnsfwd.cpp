@@ -34,6 +34,8 @@ int main(int argc, char** argv)
   try {
     dnsfwd::config config;
     setup_config(config, argc, argv);
+    // Before allocating anything so that memory is local to the CPUs:
+    setup_affinity(config);
 
     boost::asio::io_service io_service;
     dnsfwd::service service(io_service, std::move(config));
@@ -29,13 +29,17 @@ THE SOFTWARE.
 #include <arpa/inet.h>
 
 #include <cstdint>
+#include <cstring>
 
 #include <iostream>
 #include <memory>
 #include <vector>
 #include <array>
+#include <map>
 #include <string>
 #include <chrono>
+#include <type_traits>
+#include <utility>
 
 #include <boost/bind.hpp>
 
@@ -51,6 +55,8 @@ THE SOFTWARE.
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/placeholders.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/generic/datagram_protocol.hpp>
@@ -60,7 +66,24 @@ THE SOFTWARE.
 
 namespace dnsfwd {
 
+#ifdef DNSFWD_SIMULATION
+// Virtual time advanced by the simulator (see tools/simulation.cpp):
+struct clock_type {
+  typedef std::chrono::nanoseconds duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<clock_type> time_point;
+  static const bool is_steady = true;
+  static time_point now();
+};
+typedef boost::asio::basic_waitable_timer<clock_type> timer_type;
+#else
+typedef std::chrono::steady_clock clock_type;
+typedef boost::asio::steady_timer timer_type;
+#endif
+
 struct endpoint;
+struct upstream;
 class message;
 class server;
 class client;
@@ -70,6 +93,11 @@ struct order_message_by_server_id;
 struct order_message_by_client_id;
 
 const size_t MIN_MESSAGE_SIZE = 12;
+const size_t MAX_QUERY_SIZE = 1024;
+// Largest UDP response to a client which does not use EDNS:
+const size_t MAX_UDP_RESPONSE_SIZE = 512;
+const size_t MAX_NAME_SIZE = 255;
+const size_t MAX_LABELS = 128;
 extern int loglevel;
 extern const char** logformat;
 
@@ -84,66 +112,272 @@ struct deleter {
 struct endpoint {
   std::string name;
   std::string port;
+  // HTTP path for DNS over HTTPS (empty for DNS/TCP):
+  std::string path;
 
   boost::asio::ip::udp::endpoint udp_endpoint(
     boost::asio::io_service& service, const char* default_port) const;
 };
 
+inline bool operator==(endpoint const& a, endpoint const& b)
+{
+  return a.name == b.name && a.port == b.port && a.path == b.path;
+}
+
+// Queries for names under the given domain are forwarded to another upstream:
+struct route {
+  std::string domain;
+  std::vector<endpoint> connect_tcp;
+};
+
 struct config {
   std::vector<std::string> args;
   std::vector<endpoint> bind_udp;
   std::vector<endpoint> connect_tcp;
+  std::vector<route> routes;
+  std::string blocklist;
+  bool blocklist_null = false;
+  std::vector<int> cpus;
   int listen_fds = 0;
+  std::size_t standby = 0;
+  int keepalive = 0;
+  bool tcp_fastopen = false;
+  std::size_t trace_slow = 0;
+  std::size_t trace_sample = 1;
+  // Health checks of the upstream connections (0 to disable):
+  int health_interval = 0;
+  int health_timeout = 1000;
+  // Requests of a client waiting for an upstream connection (0 for no limit):
+  std::size_t flow_queue = 10000;
+  // Requests in flight on an upstream connection (0 for no limit):
+  std::size_t max_inflight = 0;
 };
 
 void setup_config(dnsfwd::config& config, int argc, char** argv);
+bool reload_config(dnsfwd::config& config);
+void setup_affinity(dnsfwd::config const& config);
+#ifdef DNSFWD_SIMULATION
+// Connect to the simulated upstream (returns a stream socket or -1):
+int simulated_connect();
+#endif
 
-class message {
+const std::uint16_t TYPE_OPT = 41;
+const unsigned RCODE_SERVFAIL = 2;
+const unsigned RCODE_NXDOMAIN = 3;
+
+// Bounds-checked view of the header, question and EDNS OPT record of a
+// DNS message. It does not own nor copy the message data.
+class message_view {
+public:
+  bool parse(const char* data, std::size_t size);
+  bool parse_edns();
+
+  std::uint16_t id() const
+  {
+    std::uint16_t res;
+    std::memcpy(&res, data_, sizeof(res));
+    return res;
+  }
+  bool qr() const
+  {
+    return flags_ & 0x8000;
+  }
+  unsigned opcode() const
+  {
+    return (flags_ >> 11) & 0xF;
+  }
+  unsigned rcode() const
+  {
+    return flags_ & 0xF;
+  }
+  std::uint16_t qdcount() const { return qdcount_; }
+  std::uint16_t ancount() const { return ancount_; }
+  std::uint16_t nscount() const { return nscount_; }
+  std::uint16_t arcount() const { return arcount_; }
+
+  // Wire format name of the question (nullptr if there is no question):
+  const char* qname() const { return qname_; }
+  std::size_t qname_size() const { return qname_size_; }
+  std::uint16_t qtype() const { return qtype_; }
+  std::uint16_t qclass() const { return qclass_; }
+  std::size_t question_end() const { return question_end_; }
+
+  // Available after parse_edns():
+  bool edns() const { return edns_; }
+  std::uint16_t udp_payload_size() const { return udp_payload_size_; }
+  bool dnssec_ok() const
+  {
+    return edns_ttl_ & 0x8000;
+  }
+private:
+  std::size_t skip_name(std::size_t pos) const;
+private:
+  const char* data_;
+  std::size_t size_;
+  std::uint16_t flags_;
+  std::uint16_t qdcount_;
+  std::uint16_t ancount_;
+  std::uint16_t nscount_;
+  std::uint16_t arcount_;
+  const char* qname_;
+  std::size_t qname_size_;
+  std::uint16_t qtype_;
+  std::uint16_t qclass_;
+  std::size_t question_end_;
+  bool edns_;
+  std::uint16_t udp_payload_size_;
+  std::uint32_t edns_ttl_;
+};
+
+const std::uint64_t NAME_HASH_SEED = 14695981039346656037ull;
+
+std::uint64_t hash_label(std::uint64_t hash, const char* label);
+std::uint64_t hash_name(const char* name, std::size_t size);
+bool wire_name(std::string const& name, std::string& res);
+bool same_domain(std::string const& a, std::string const& b);
+std::string text_name(const char* name, std::size_t size);
+bool same_name(const char* a, const char* b, std::size_t size);
+bool same_question(message_view const& request, message_view const& reply);
+std::size_t error_response(
+  char* buffer, message_view const& request, unsigned rcode);
+std::size_t udp_response_size(message_view& request);
+std::size_t truncated_response(char* buffer, message_view const& response);
+
+// Health check query (". IN NS") prefixed by its length. Its message ID is
+// reserved: it is never used for the forwarded requests.
+const std::uint16_t PROBE_ID = 0;
+const std::size_t PROBE_QUERY_SIZE = 17;
+extern const char PROBE_QUERY[sizeof(std::uint16_t) + PROBE_QUERY_SIZE];
+
+// Requests in flight on a connection. Their message IDs are drawn at random
+// among the free ones: part of the ID space is kept free.
+const std::size_t MAX_CONNECTION_REQUESTS = 60000;
+
+// Maximum duration of a connection attempt (name resolution included):
+const clock_type::duration CONNECT_TIMEOUT = std::chrono::seconds(5);
+
+// Hash table of domain names for longest suffix matching:
+class suffix_table {
 public:
-  message() : buffer_(1024), server_(nullptr)
+  suffix_table();
+  void insert(std::string const& name, int value);
+  int find(const char* name, std::size_t size) const;
+  std::size_t size() const
   {
+    return count_;
   }
+private:
+  struct entry {
+    std::uint64_t hash = 0;
+    std::uint32_t offset = 0;
+    std::uint16_t size = 0;
+    int value = -1;
+  };
+  std::size_t slot(std::uint64_t hash, const char* name, std::size_t size) const;
+  void grow();
+private:
+  std::vector<entry> entries_;
+  std::string names_;
+  std::size_t count_;
+};
+
+// Timestamps of the processing stages of a sampled query:
+struct query_trace {
+  clock_type::time_point received;
+  clock_type::time_point dequeued;
+  clock_type::time_point written;
+  clock_type::time_point replied;
+  clock_type::time_point sent;
+};
+
+// Coarse timestamp of the requests in milliseconds. It wraps around after
+// 49 days: only the differences are meaningful.
+typedef std::uint32_t message_time;
+
+inline message_time message_clock()
+{
+  return (message_time) std::chrono::duration_cast<std::chrono::milliseconds>(
+    clock_type::now().time_since_epoch()).count();
+}
+
+// Whether a timestamp is after another one:
+inline bool after(message_time a, message_time b)
+{
+  return (std::int32_t) (a - b) > 0;
+}
+
+// Request in flight. The record fits in a cache line: the payload is stored
+// in size-classed slabs and the source (server and client address) is an
+// index in a table shared by the requests of the same client (see
+// message.cpp). The trace of a sampled request is stored in the payload slab.
+class message {
+public:
+  message(dnsfwd::server& server,
+    boost::asio::generic::datagram_protocol::endpoint const& source,
+    const char* data, std::size_t size, bool sampled);
+  ~message();
   message(message &) = delete;
   message& operator=(message &) = delete;
+  static void* operator new(std::size_t size);
+  static void operator delete(void* pointer);
 
-  std::vector<char> buffer_;
-  std::uint16_t size_;
-  std::uint16_t network_size_;
   std::uint16_t client_id_;
   std::uint16_t server_id_;
-  std::chrono::steady_clock::time_point timestamp_;
-  boost::asio::generic::datagram_protocol::endpoint endpoint_;
-  dnsfwd::server* server_;
+  message_time timestamp_;
 
 public:
+  const char* data() const
+  {
+    return payload_ + sizeof(std::uint16_t);
+  }
+  std::size_t size() const
+  {
+    return size_;
+  }
+  dnsfwd::server& server() const;
+  boost::asio::generic::datagram_protocol::endpoint const& source() const;
+  query_trace* trace() const
+  {
+    return sampled_ ? (query_trace*) (payload_ - sizeof(query_trace)) : nullptr;
+  }
+  void mark(clock_type::time_point query_trace::* stage)
+  {
+    if (sampled_)
+      this->trace()->*stage = clock_type::now();
+  }
   std::uint16_t id() const
   {
     std::uint16_t res;
-    std::memcpy(&res, buffer_.data(), sizeof(res));
+    std::memcpy(&res, this->data(), sizeof(res));
     return res;
   }
   void id(std::uint16_t id)
   {
-    std::memcpy(buffer_.data(), &id, sizeof(id));
+    std::memcpy(payload_ + sizeof(std::uint16_t), &id, sizeof(id));
   }
-  std::array<boost::asio::const_buffer, 2> vc_buffer()
+  // The message with its length prefix:
+  boost::asio::const_buffer vc_buffer() const
   {
-    network_size_ = htons(size_);
-    return {{
-      boost::asio::buffer( &network_size_, sizeof(network_size_) ),
-      boost::asio::buffer( buffer_.data(), size_ )
-    }};
+    return boost::asio::buffer(payload_, sizeof(std::uint16_t) + size_);
   }
   bool operator==(message const& that) const {
     return this==&that;
   }
 private:
-  boost::intrusive::set_member_hook<> by_client_id_hook_;
+  typedef boost::intrusive::set_member_hook<
+    boost::intrusive::optimize_size<true>
+  > by_client_id_hook_type;
+  by_client_id_hook_type by_client_id_hook_;
   boost::intrusive::list_member_hook<> queue_hook_;
+  char* payload_;
+  std::uint32_t source_;
+  std::uint16_t size_;
+  std::uint8_t size_class_;
+  bool sampled_;
 public:
   typedef boost::intrusive::member_hook<
     message,
-    boost::intrusive::set_member_hook<>,
+    by_client_id_hook_type,
     &message::by_client_id_hook_
   > ByClientIdOptions;
   typedef boost::intrusive::member_hook<
@@ -182,43 +416,330 @@ struct order_message_by_client_id {
   }
 };
 
+// Layout of the compiled blocklist files (see dnsfwd-blocklist). The header
+// is followed by the Bloom filter words, the bucket offsets and the sorted
+// keys of the blocked names.
+struct blocklist_header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t bloom_hashes;
+  std::uint64_t bloom_bits;
+  std::uint64_t count;
+};
+
+const char BLOCKLIST_MAGIC[8] = {'D', 'N', 'S', 'F', 'W', 'D', 'B', 'L'};
+const std::uint32_t BLOCKLIST_VERSION = 1;
+const std::size_t BLOCKLIST_BUCKETS = 1 << 16;
+
+std::uint64_t blocklist_key(std::uint64_t hash);
+
+// Memory mapped blocklist:
+class blocklist {
+public:
+  blocklist(std::string const& path);
+  ~blocklist();
+  blocklist(blocklist const&) = delete;
+  blocklist& operator=(blocklist const&) = delete;
+  bool contains(const char* name, std::size_t size) const;
+  std::uint64_t size() const
+  {
+    return header_->count;
+  }
+private:
+  bool contains_key(std::uint64_t key) const;
+private:
+  void* data_;
+  std::size_t size_;
+  blocklist_header const* header_;
+  std::uint64_t const* bloom_;
+  std::uint32_t const* buckets_;
+  std::uint64_t const* keys_;
+};
+
+std::size_t blocked_response(
+  char* buffer, message_view const& request, bool null_answer);
+
+// The slowest traced queries, kept in a bounded heap:
+class slow_queries {
+public:
+  explicit slow_queries(std::size_t capacity);
+  void add(message const& query);
+  void dump() const;
+private:
+  struct entry {
+    clock_type::duration total;
+    query_trace trace;
+    std::uint16_t qtype;
+    std::uint8_t name_size;
+    char name[MAX_NAME_SIZE];
+  };
+  struct slower {
+    bool operator()(entry const& a, entry const& b) const
+    {
+      return a.total > b.total;
+    }
+  };
+  std::vector<entry> entries_;
+  std::size_t capacity_;
+};
+
+// Storage for the completion handler of the (single) operation of a kind
+// in progress on a socket, reused by all of them instead of allocating one
+// for each operation. Larger handlers fall back to the heap.
+class handler_memory {
+public:
+  handler_memory() : in_use_(false) {}
+  handler_memory(handler_memory const&) = delete;
+  handler_memory& operator=(handler_memory const&) = delete;
+  void* allocate(std::size_t size)
+  {
+    if (!in_use_ && size <= sizeof(storage_)) {
+      in_use_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+  void deallocate(void* pointer)
+  {
+    if (pointer == &storage_)
+      in_use_ = false;
+    else
+      ::operator delete(pointer);
+  }
+private:
+  std::aligned_storage<256>::type storage_;
+  bool in_use_;
+};
+
+template<class T>
+class handler_allocator {
+public:
+  typedef T value_type;
+  explicit handler_allocator(handler_memory& memory) : memory_(&memory) {}
+  template<class U>
+  handler_allocator(handler_allocator<U> const& that) : memory_(that.memory_) {}
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+  }
+  void deallocate(T* pointer, std::size_t)
+  {
+    memory_->deallocate(pointer);
+  }
+  bool operator==(handler_allocator const& that) const
+  {
+    return memory_ == that.memory_;
+  }
+  bool operator!=(handler_allocator const& that) const
+  {
+    return memory_ != that.memory_;
+  }
+private:
+  template<class U> friend class handler_allocator;
+  handler_memory* memory_;
+};
+
+// Completion handler allocated in a handler_memory:
+template<class Handler>
+class allocated_handler {
+public:
+  typedef handler_allocator<Handler> allocator_type;
+  allocated_handler(handler_memory& memory, Handler handler)
+    : memory_(&memory), handler_(std::move(handler)) {}
+  allocator_type get_allocator() const
+  {
+    return allocator_type(*memory_);
+  }
+  template<class... Args>
+  void operator()(Args&&... args)
+  {
+    handler_(std::forward<Args>(args)...);
+  }
+private:
+  handler_memory* memory_;
+  Handler handler_;
+};
+
+template<class Handler>
+allocated_handler<Handler> make_allocated_handler(handler_memory& memory,
+  Handler handler)
+{
+  return allocated_handler<Handler>(memory, std::move(handler));
+}
+
+// Queue of the requests waiting for an upstream connection, shared fairly
+// between the clients: the requests are hashed by client address and server
+// socket into a fixed number of flows which are served in deficit round
+// robin, so that a chatty client only delays its own requests.
+class fair_queue {
+public:
+  fair_queue();
+  ~fair_queue();
+  fair_queue(fair_queue const&) = delete;
+  fair_queue& operator=(fair_queue const&) = delete;
+  // Append a request unless its flow already holds the given number of
+  // requests (0 for no limit):
+  bool push(message& request, std::size_t limit);
+  message* pop();
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+  std::size_t size() const
+  {
+    return size_;
+  }
+private:
+  typedef boost::intrusive::list<
+    message, message::QueueOptions, boost::intrusive::cache_last<true>
+  > queue_type;
+  struct flow {
+    queue_type queue;
+    std::size_t deficit = 0;
+    boost::intrusive::list_member_hook<> active_hook;
+  };
+  typedef boost::intrusive::list<
+    flow,
+    boost::intrusive::member_hook<
+      flow, boost::intrusive::list_member_hook<>, &flow::active_hook>,
+    boost::intrusive::cache_last<true>
+  > active_type;
+  flow& flow_of(message const& request);
+private:
+  // Allocated with the first request:
+  std::unique_ptr<flow[]> flows_;
+  // Flows with requests, in service order:
+  active_type active_;
+  std::size_t size_;
+};
+
+// Consecutive failed health checks (or connections) opening the circuit
+// breaker of an upstream:
+const unsigned MAX_HEALTH_FAILURES = 3;
+// Requests in flight allowed when an upstream recovers, raised by one for
+// each reply until the limit is lifted:
+const std::size_t RECOVERY_ADMISSION = 4;
+const std::size_t MAX_RECOVERY_ADMISSION = 1024;
+
+// Group of upstream servers with its connection and pending requests:
+struct upstream {
+  std::vector<endpoint> connect_tcp;
+  std::shared_ptr<dnsfwd::client> client;
+  // Connections (being established or idle) ready to replace the active
+  // one:
+  std::vector<std::shared_ptr<dnsfwd::client>> standby;
+  fair_queue queue;
+  // Removed from the configuration, it only answers its pending requests:
+  bool retired = false;
+  clock_type::time_point deadline;
+  // Circuit breaker: while it is down the queries are answered with SERVFAIL
+  // and a connection is attempted again after the retry time.
+  unsigned failures = 0;
+  bool down = false;
+  clock_type::time_point retry;
+  // Maximum number of requests in flight on a connection (0 for no limit):
+  std::size_t admitted = 0;
+};
+
 class server {
 public:
   server(boost::asio::io_service& io_service, service& service,
     dnsfwd::endpoint const& udp_endpoint);
   server(boost::asio::io_service& io_service, service& service, int socket);
 public:
-  void send_response(
-    std::vector<char> response,
-    boost::asio::generic::datagram_protocol::endpoint endpoint);
+  void send_response(message const& request, const char* data,
+    std::size_t size);
+  int native_handle()
+  {
+    return socket_.native_handle();
+  }
+  void stop();
+  // No request from this server is pending:
+  bool idle() const
+  {
+    return pending_ == 0;
+  }
+  boost::asio::generic::datagram_protocol::endpoint local_endpoint() const
+  {
+    boost::system::error_code ec;
+    return socket_.local_endpoint(ec);
+  }
+  int incoming_cpu();
 private:
+  friend class message;
   void start_receive();
   void on_message(const boost::system::error_code& error, std::size_t size);
-  void response_sent(std::vector<char>& response,
-    const boost::system::error_code& error, std::size_t size);
+  bool valid_request(std::size_t size);
+  void response_sent(std::shared_ptr<std::vector<char>> const& response,
+    const void* request, const boost::system::error_code& error,
+    std::size_t size);
 private:
   service* service_;
   boost::asio::generic::datagram_protocol::socket socket_;
-  std::unique_ptr<message> context_;
+  std::vector<char> buffer_;
+  boost::asio::generic::datagram_protocol::endpoint sender_;
+  handler_memory receive_memory_;
+  std::size_t pending_;
+  bool stopped_;
 };
 
 class client
   : public std::enable_shared_from_this<client> {
 public:
-  client(boost::asio::io_service& io_service, service& service);
-  ~client();
+  client(boost::asio::io_service& io_service, service& service,
+    dnsfwd::upstream& upstream);
+  virtual ~client();
+  dnsfwd::upstream& upstream()
+  {
+    return *upstream_;
+  }
   bool add_request(std::unique_ptr<message>& context);
   std::uint16_t random_client_id();
   void connect();
-private:
+  bool connecting() const
+  {
+    return connecting_;
+  }
+  void stop()
+  {
+    this->reset();
+  }
+  void fail_requests();
+  virtual void send();
+  bool idle() const
+  {
+    return !context_ && by_client_id_.empty();
+  }
+protected:
+  // Only the active client of the upstream takes requests:
+  bool active() const
+  {
+    return upstream_->client.get() == this;
+  }
+  virtual void start();
+  virtual std::size_t on_input(const char* data, std::size_t size);
   void start_receive();
-  void on_message_size(const boost::system::error_code& error, std::size_t size);
-  void on_message(const boost::system::error_code& error, std::size_t size);
+  void on_reply(const char* data, std::size_t size);
   void reset();
-  void send();
-  void on_send(const boost::system::error_code& error, std::size_t bytes_transferred);
-  void clear(std::chrono::steady_clock::time_point time);
+  void release();
+  void on_written();
+  std::size_t clear(message_time time);
+  bool admitted() const;
 private:
+  void connect_next();
+  void on_resolve(const boost::system::error_code& error,
+    boost::asio::ip::tcp::resolver::results_type results);
+  void on_connect(const boost::system::error_code& error);
+  void on_connect_timer(const boost::system::error_code& error);
+  void connect_failed();
+  void on_connected();
+  void probe();
+  void wait_probe(clock_type::duration delay);
+  void on_probe_timer(const boost::system::error_code& error);
+  void on_probe_reply(const char* data, std::size_t size);
+  void on_read(const boost::system::error_code& error, std::size_t size);
+  void on_send(const boost::system::error_code& error, std::size_t bytes_transferred);
+protected:
   typedef boost::intrusive::set<
     message,
     message::ByClientIdOptions,
@@ -231,13 +752,82 @@ private:
 
   boost::asio::io_service* io_service_;
   service* service_;
+  dnsfwd::upstream* upstream_;
   boost::asio::ip::tcp::socket socket_;
   by_client_id_type by_client_id_;
   queue_type queue_;
   std::unique_ptr<message> context_;
+  // The completion handlers do not hold a reference to the client: it keeps
+  // itself alive while it is connected or has operations in progress.
+  std::shared_ptr<client> self_;
+  unsigned pending_;
+  // Client IDs of the sampled requests being written:
+  std::vector<std::uint16_t> traced_writes_;
+  handler_memory read_memory_;
+  handler_memory write_memory_;
+  // The health check query is waiting to be written:
+  bool probe_queued_;
+  // The connection is not established yet: the requests wait.
+  bool connecting_;
+private:
+  // Large enough for a partial message and a complete one:
+  static const std::size_t INPUT_BUFFER_SIZE = 1 << 17;
+  std::vector<char> input_;
+  std::size_t input_start_;
+  std::size_t input_end_;
+  // Size of the request being written, 0 when idle:
+  std::size_t sending_;
+  // Health check interval or, while a probe is in flight, its timeout:
+  timer_type probe_timer_;
+  bool probing_;
+  boost::asio::ip::tcp::resolver resolver_;
+  // Resolved addresses, tried in turn:
+  std::vector<boost::asio::ip::tcp::endpoint> endpoints_;
+  std::size_t next_endpoint_;
+  timer_type connect_timer_;
+};
 
-  std::uint16_t response_size_;
-  std::vector<char> buffer_;
+// DNS over HTTPS (RFC 8484) client multiplexing the requests as HTTP/2
+// streams. The TLS encapsulation is expected to be done by stunnel as for
+// DNS/TCP.
+class http2_client : public client {
+public:
+  http2_client(boost::asio::io_service& io_service, service& service,
+    dnsfwd::upstream& upstream);
+protected:
+  void start() override;
+  std::size_t on_input(const char* data, std::size_t size) override;
+  void send() override;
+private:
+  struct stream {
+    std::uint16_t client_id;
+    std::vector<char> body;
+  };
+  void add_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+    const char* payload, std::size_t size);
+  void add_request_frames(const char* data, std::size_t size,
+    std::uint32_t stream_id);
+  void flush();
+  void on_write(const boost::system::error_code& error);
+  void on_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+    const char* payload, std::size_t size);
+  void on_data(std::uint8_t flags, std::uint32_t stream_id,
+    const char* payload, std::size_t size);
+  void on_settings(std::uint8_t flags, const char* payload, std::size_t size);
+  void on_window_update(std::uint32_t stream_id,
+    const char* payload, std::size_t size);
+  void end_stream(std::uint32_t stream_id, bool complete);
+  void fail_request(std::uint16_t client_id);
+private:
+  std::string headers_;
+  std::vector<char> output_;
+  std::vector<char> writing_;
+  std::vector<std::uint16_t> traced_output_;
+  std::map<std::uint32_t, stream> streams_;
+  std::uint32_t next_stream_id_;
+  std::uint32_t max_streams_;
+  std::int64_t send_window_;
+  std::size_t received_;
 };
 
 class service {
@@ -248,33 +838,66 @@ public:
   {
     return (std::uint16_t) random_();
   }
-  // TODO, remove this
-  std::vector<endpoint> const& tcp_connect_endpoints()
-  {
-    return config_.connect_tcp;
-  }
   std::vector<endpoint> const& udp_listen_endpoints()
   {
     return config_.bind_udp;
   }
-  std::unique_ptr<message> unqueue();
+  dnsfwd::config const& config() const
+  {
+    return config_;
+  }
+  void connect(dnsfwd::upstream& upstream);
+  std::unique_ptr<message> unqueue(dnsfwd::upstream& upstream);
   void unregister(std::shared_ptr<client> client);
   std::chrono::seconds time_to_live() const
   {
     return std::chrono::seconds(60);
   }
+  bool handoff();
+  // Whether to trace the stages of a new query:
+  bool sample()
+  {
+    return config_.trace_slow && ++trace_count_ % config_.trace_sample == 0;
+  }
+  void trace(message const& query)
+  {
+    slow_queries_.add(query);
+  }
+  void upstream_failed(dnsfwd::upstream& upstream);
+  void upstream_healthy(dnsfwd::upstream& upstream);
+  void fail(std::unique_ptr<message> context);
+private:
+  void on_signal(const boost::system::error_code& error, int signal_number);
+  void on_drain_timer(const boost::system::error_code& error);
+  void reload();
+  std::unique_ptr<dnsfwd::upstream> take_upstream(
+    std::vector<endpoint> const& connect_tcp);
+  void setup_upstreams(dnsfwd::config const& config);
+  void retire(std::unique_ptr<dnsfwd::upstream> upstream);
+  void on_retire_timer(const boost::system::error_code& error);
+  void connect_all();
+  std::shared_ptr<client> make_client(dnsfwd::upstream& upstream);
+  void fill_standby(dnsfwd::upstream& upstream);
+  dnsfwd::upstream& route(message_view const& request);
+  bool block(std::unique_ptr<message>& context, message_view const& request);
 private:
-
-  typedef boost::intrusive::list<
-    message, message::QueueOptions, boost::intrusive::cache_last<true>
-  > queue_type;
-
   boost::asio::io_service* io_service_;
   dnsfwd::config config_;
   std::vector<std::unique_ptr<server>> servers_;
-  std::shared_ptr<client> client_;
+  // Removed by a reload, destroyed once their requests are answered:
+  std::vector<std::unique_ptr<server>> retired_servers_;
+  std::vector<std::unique_ptr<upstream>> retired_upstreams_;
+  timer_type retire_timer_;
+  // The first upstream is the default one, the others are used for routes:
+  std::vector<std::unique_ptr<upstream>> upstreams_;
+  suffix_table routes_;
+  std::shared_ptr<blocklist> blocklist_;
   boost::random::mt11213b random_;
-  queue_type queue_;
+  boost::asio::signal_set signals_;
+  timer_type drain_timer_;
+  clock_type::time_point drain_deadline_;
+  slow_queries slow_queries_;
+  std::uint64_t trace_count_;
 };
 
 }
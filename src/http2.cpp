@@ -0,0 +1,464 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+#include "probes.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <boost/asio/write.hpp>
+
+#include <boost/system/error_code.hpp>
+
+namespace dnsfwd {
+
+namespace {
+
+const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+const std::uint8_t FRAME_DATA = 0;
+const std::uint8_t FRAME_HEADERS = 1;
+const std::uint8_t FRAME_RST_STREAM = 3;
+const std::uint8_t FRAME_SETTINGS = 4;
+const std::uint8_t FRAME_PING = 6;
+const std::uint8_t FRAME_GOAWAY = 7;
+const std::uint8_t FRAME_WINDOW_UPDATE = 8;
+
+const std::uint8_t FLAG_END_STREAM = 0x1;
+const std::uint8_t FLAG_ACK = 0x1;
+const std::uint8_t FLAG_END_HEADERS = 0x4;
+const std::uint8_t FLAG_PADDED = 0x8;
+
+const std::uint32_t ERROR_CANCEL = 0x8;
+
+const std::uint16_t SETTINGS_ENABLE_PUSH = 2;
+const std::uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 3;
+const std::uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 4;
+
+const std::size_t FRAME_HEADER_SIZE = 9;
+const std::size_t MAX_FRAME_SIZE = 16384;
+const std::uint32_t MAX_STREAM_ID = 0x7FFFFFFF;
+const std::uint32_t DEFAULT_WINDOW = 65535;
+// Our receive windows: a stream never needs a window update (DNS messages
+// are smaller than 64KiB) and the connection window is replenished when
+// half of it has been consumed.
+const std::uint32_t STREAM_WINDOW = 1 << 20;
+const std::uint32_t CONNECTION_WINDOW = 1 << 24;
+// Until the server announces its limit:
+const std::uint32_t DEFAULT_MAX_STREAMS = 100;
+
+const char DNS_MESSAGE[] = "application/dns-message";
+
+void put_u16(char* p, std::uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value;
+}
+
+void put_u32(char* p, std::uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+std::uint32_t get_u32(const unsigned char* p)
+{
+  return ((std::uint32_t) p[0] << 24) | ((std::uint32_t) p[1] << 16)
+    | ((std::uint32_t) p[2] << 8) | p[3];
+}
+
+// HPACK integer with a N-bit prefix:
+void add_integer(std::string& out, std::uint8_t first, unsigned prefix,
+  std::size_t value)
+{
+  std::size_t max = (1 << prefix) - 1;
+  if (value < max) {
+    out.push_back((char) (first | value));
+    return;
+  }
+  out.push_back((char) (first | max));
+  value -= max;
+  while (value >= 128) {
+    out.push_back((char) (0x80 | (value & 0x7F)));
+    value >>= 7;
+  }
+  out.push_back((char) value);
+}
+
+// HPACK string literal (without Huffman coding):
+void add_string(std::string& out, std::string const& value)
+{
+  add_integer(out, 0, 7, value.size());
+  out += value;
+}
+
+// HPACK literal header field without indexing with an indexed name:
+void add_header(std::string& out, std::size_t name_index, std::string const& value)
+{
+  add_integer(out, 0, 4, name_index);
+  add_string(out, value);
+}
+
+}
+
+http2_client::http2_client(boost::asio::io_service& io_service,
+    service& service, dnsfwd::upstream& upstream)
+  : client(io_service, service, upstream),
+    next_stream_id_(1),
+    max_streams_(DEFAULT_MAX_STREAMS),
+    send_window_(DEFAULT_WINDOW),
+    received_(0)
+{
+  // The header block is the same for all the requests except for the
+  // content-length (see the HPACK static table):
+  dnsfwd::endpoint const& endpoint = upstream.connect_tcp.at(0);
+  headers_ += '\x83'; // :method: POST
+  headers_ += '\x87'; // :scheme: https
+  add_header(headers_, 4, endpoint.path);
+  add_header(headers_, 1, endpoint.name);
+  add_header(headers_, 31, DNS_MESSAGE);
+  add_header(headers_, 19, DNS_MESSAGE);
+}
+
+void http2_client::start()
+{
+  output_.insert(output_.end(), PREFACE, PREFACE + sizeof(PREFACE) - 1);
+
+  char settings[12];
+  put_u16(settings, SETTINGS_ENABLE_PUSH);
+  put_u32(settings + 2, 0);
+  put_u16(settings + 6, SETTINGS_INITIAL_WINDOW_SIZE);
+  put_u32(settings + 8, STREAM_WINDOW);
+  this->add_frame(FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+  char increment[4];
+  put_u32(increment, CONNECTION_WINDOW - DEFAULT_WINDOW);
+  this->add_frame(FRAME_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+
+  this->start_receive();
+  this->send();
+}
+
+void http2_client::add_frame(std::uint8_t type, std::uint8_t flags,
+  std::uint32_t stream_id, const char* payload, std::size_t size)
+{
+  char header[9];
+  header[0] = size >> 16;
+  header[1] = size >> 8;
+  header[2] = size;
+  header[3] = type;
+  header[4] = flags;
+  put_u32(header + 5, stream_id);
+  output_.insert(output_.end(), header, header + sizeof(header));
+  output_.insert(output_.end(), payload, payload + size);
+}
+
+void http2_client::add_request_frames(const char* data, std::size_t size,
+  std::uint32_t stream_id)
+{
+  std::string headers = headers_;
+  add_header(headers, 28, std::to_string(size));
+  this->add_frame(FRAME_HEADERS, FLAG_END_HEADERS, stream_id,
+    headers.data(), headers.size());
+  this->add_frame(FRAME_DATA, FLAG_END_STREAM, stream_id, data, size);
+}
+
+void http2_client::send()
+{
+  if (!socket_.is_open() || connecting_)
+    return;
+
+  if (this->clear(message_clock() - service_->time_to_live().count() * 1000)) {
+    // Cancel the streams of the expired requests so that they do not count
+    // against the concurrency limit of the server:
+    for (auto i = streams_.begin(); i != streams_.end();) {
+      if (i->second.client_id != PROBE_ID
+          && by_client_id_.find(i->second.client_id, order_message_by_client_id())
+          == by_client_id_.end()) {
+        char code[4];
+        put_u32(code, ERROR_CANCEL);
+        this->add_frame(FRAME_RST_STREAM, 0, i->first, code, sizeof(code));
+        i = streams_.erase(i);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  if (probe_queued_ && streams_.size() < max_streams_
+      && send_window_ >= (std::int64_t) PROBE_QUERY_SIZE
+      && next_stream_id_ <= MAX_STREAM_ID) {
+    LOG(DEBUG) << "Sending health check\n";
+    probe_queued_ = false;
+    this->add_request_frames(PROBE_QUERY + sizeof(std::uint16_t),
+      PROBE_QUERY_SIZE, next_stream_id_);
+    streams_[next_stream_id_].client_id = PROBE_ID;
+    next_stream_id_ += 2;
+    send_window_ -= PROBE_QUERY_SIZE;
+  }
+
+  // Send as many requests as allowed by the server:
+  while (streams_.size() < max_streams_ && this->admitted()) {
+    if (!context_) {
+      if (!this->active())
+        break;
+      context_ = service_->unqueue(*upstream_);
+      if (!context_)
+        break;
+    }
+    if (send_window_ < (std::int64_t) context_->size())
+      break;
+    if (next_stream_id_ > MAX_STREAM_ID) {
+      LOG(NOTICE) << "HTTP/2 stream identifiers exhausted\n";
+      this->reset();
+      return;
+    }
+
+    context_->mark(&query_trace::dequeued);
+    context_->client_id_ = this->random_client_id();
+    context_->id(context_->client_id_);
+    this->add_request_frames(context_->data(), context_->size(),
+      next_stream_id_);
+    if (context_->trace())
+      traced_output_.push_back(context_->client_id_);
+    streams_[next_stream_id_].client_id = context_->client_id_;
+    next_stream_id_ += 2;
+    send_window_ -= context_->size();
+
+    LOG(DEBUG) << "Forwarding request\n";
+    PROBE3(query__forwarded, context_.get(), ntohs(context_->client_id_),
+      context_->size());
+    context_->timestamp_ = message_clock();
+    this->by_client_id_.insert(*context_);
+    this->queue_.push_back(*context_);
+    context_.release();
+  }
+
+  this->flush();
+}
+
+void http2_client::flush()
+{
+  if (!writing_.empty() || output_.empty())
+    return;
+  writing_.swap(output_);
+  traced_writes_.swap(traced_output_);
+  pending_++;
+  boost::asio::async_write(
+    socket_,
+    boost::asio::buffer(writing_),
+    make_allocated_handler(write_memory_,
+      boost::bind(
+        &http2_client::on_write,
+        this,
+        boost::asio::placeholders::error
+      )
+    )
+  );
+}
+
+void http2_client::on_write(const boost::system::error_code& error)
+{
+  pending_--;
+  if (!socket_.is_open()) {
+    this->release();
+    return;
+  }
+  if (error) {
+    LOG(ERR) << "HTTP/2 write error: " << error << '\n';
+    this->reset();
+    return;
+  }
+  LOG(DEBUG) << "HTTP/2 frames written\n";
+  writing_.clear();
+  this->on_written();
+  this->flush();
+}
+
+// Handle all the complete frames received:
+std::size_t http2_client::on_input(const char* data, std::size_t size)
+{
+  std::size_t consumed = 0;
+  while (size - consumed >= FRAME_HEADER_SIZE) {
+    const unsigned char* p = (const unsigned char*) data + consumed;
+    std::size_t length = (p[0] << 16) | (p[1] << 8) | p[2];
+    if (length > MAX_FRAME_SIZE) {
+      LOG(ERR) << "HTTP/2 frame too large\n";
+      this->reset();
+      return consumed;
+    }
+    if (size - consumed < FRAME_HEADER_SIZE + length)
+      break;
+    this->on_frame(p[3], p[4], get_u32(p + 5) & MAX_STREAM_ID,
+      data + consumed + FRAME_HEADER_SIZE, length);
+    consumed += FRAME_HEADER_SIZE + length;
+    if (!socket_.is_open())
+      break;
+  }
+  return consumed;
+}
+
+void http2_client::on_frame(std::uint8_t type, std::uint8_t flags,
+  std::uint32_t stream_id, const char* payload, std::size_t size)
+{
+  switch (type) {
+  case FRAME_DATA:
+    this->on_data(flags, stream_id, payload, size);
+    break;
+  case FRAME_HEADERS:
+    // The response headers (and the status) are not decoded: an error
+    // response is rejected as an invalid DNS message.
+    if (flags & FLAG_END_STREAM)
+      this->end_stream(stream_id, true);
+    break;
+  case FRAME_RST_STREAM:
+    LOG(ERR) << "HTTP/2 stream reset\n";
+    this->end_stream(stream_id, false);
+    break;
+  case FRAME_SETTINGS:
+    this->on_settings(flags, payload, size);
+    break;
+  case FRAME_PING:
+    if (!(flags & FLAG_ACK) && size == 8) {
+      this->add_frame(FRAME_PING, FLAG_ACK, 0, payload, size);
+      this->flush();
+    }
+    break;
+  case FRAME_GOAWAY:
+    LOG(NOTICE) << "HTTP/2 connection closed by the server\n";
+    this->reset();
+    break;
+  case FRAME_WINDOW_UPDATE:
+    this->on_window_update(stream_id, payload, size);
+    break;
+  default:
+    break;
+  }
+}
+
+void http2_client::on_data(std::uint8_t flags, std::uint32_t stream_id,
+  const char* payload, std::size_t length)
+{
+  const char* data = payload;
+  std::size_t size = length;
+  if (flags & FLAG_PADDED) {
+    std::size_t padding = size ? (std::uint8_t) data[0] + 1 : 0;
+    if (padding == 0 || padding > size) {
+      LOG(ERR) << "Invalid HTTP/2 padding\n";
+      this->reset();
+      return;
+    }
+    data += 1;
+    size -= padding;
+  }
+
+  auto i = streams_.find(stream_id);
+  if (i != streams_.end())
+    i->second.body.insert(i->second.body.end(), data, data + size);
+
+  // Keep the connection window open:
+  received_ += length;
+  if (received_ >= CONNECTION_WINDOW / 2) {
+    char increment[4];
+    put_u32(increment, received_);
+    this->add_frame(FRAME_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+    this->flush();
+    received_ = 0;
+  }
+
+  if (flags & FLAG_END_STREAM)
+    this->end_stream(stream_id, true);
+}
+
+void http2_client::end_stream(std::uint32_t stream_id, bool complete)
+{
+  auto i = streams_.find(stream_id);
+  if (i == streams_.end())
+    return;
+  std::uint16_t client_id = i->second.client_id;
+  std::vector<char> body = std::move(i->second.body);
+  streams_.erase(i);
+
+  // The reply must carry the message ID of the request of its stream:
+  std::uint16_t id;
+  if (complete && body.size() >= sizeof(id)) {
+    std::memcpy(&id, body.data(), sizeof(id));
+    if (id == client_id)
+      this->on_reply(body.data(), body.size());
+    else
+      LOG(ERR) << "HTTP/2 reply does not match its stream\n";
+  }
+  // There will be no other reply for this request if this one was rejected
+  // (an HTTP error for example) or if the stream was reset:
+  this->fail_request(client_id);
+
+  // A stream is available:
+  this->send();
+}
+
+// Answer SERVFAIL to a request which is still in flight:
+void http2_client::fail_request(std::uint16_t client_id)
+{
+  if (client_id == PROBE_ID)
+    return;
+  auto i = by_client_id_.find(client_id, order_message_by_client_id());
+  if (i == by_client_id_.end())
+    return;
+  message& c = *i;
+  by_client_id_.erase(i);
+  queue_.erase(queue_.iterator_to(c));
+  service_->fail(std::unique_ptr<message>(&c));
+}
+
+void http2_client::on_settings(std::uint8_t flags,
+  const char* payload, std::size_t size)
+{
+  if (flags & FLAG_ACK)
+    return;
+  const unsigned char* p = (const unsigned char*) payload;
+  for (std::size_t i = 0; i + 6 <= size; i += 6) {
+    std::uint16_t id = (p[i] << 8) | p[i + 1];
+    std::uint32_t value = get_u32(p + i + 2);
+    if (id == SETTINGS_MAX_CONCURRENT_STREAMS) {
+      LOG(DEBUG) << "HTTP/2 server allows " << value << " streams\n";
+      max_streams_ = value;
+    }
+  }
+  this->add_frame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+  this->send();
+}
+
+void http2_client::on_window_update(std::uint32_t stream_id,
+  const char* payload, std::size_t size)
+{
+  if (stream_id != 0 || size != 4)
+    return;
+  send_window_ += get_u32((const unsigned char*) payload) & 0x7FFFFFFF;
+  this->send();
+}
+
+}
@@ -0,0 +1,214 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace dnsfwd {
+
+static_assert(sizeof(message) <= 64, "message record larger than a cache line");
+
+namespace {
+
+// Size classes of the slabs (the smallest one is used for the records):
+const std::size_t SIZE_CLASSES[] = { 64, 128, 256, 512, 1024, 2048 };
+const std::size_t SIZE_CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+const std::size_t SLAB_SIZE = 1 << 16;
+
+// Fixed size chunks carved from large slabs. The free chunks are kept in
+// a list for reuse and the slabs are never released.
+class slab_allocator {
+public:
+  std::uint8_t size_class(std::size_t size) const
+  {
+    std::uint8_t i = 0;
+    while (SIZE_CLASSES[i] < size)
+      ++i;
+    return i;
+  }
+  void* allocate(std::uint8_t size_class)
+  {
+    free_chunk*& head = free_[size_class];
+    if (!head)
+      this->grow(size_class);
+    free_chunk* chunk = head;
+    head = chunk->next;
+    return chunk;
+  }
+  void deallocate(std::uint8_t size_class, void* pointer)
+  {
+    free_chunk* chunk = static_cast<free_chunk*>(pointer);
+    chunk->next = free_[size_class];
+    free_[size_class] = chunk;
+  }
+private:
+  struct free_chunk {
+    free_chunk* next;
+  };
+  void grow(std::uint8_t size_class)
+  {
+    std::size_t size = SIZE_CLASSES[size_class];
+    char* slab = static_cast<char*>(::operator new(SLAB_SIZE));
+    for (std::size_t i = SLAB_SIZE / size; i != 0; --i)
+      this->deallocate(size_class, slab + (i - 1) * size);
+  }
+private:
+  free_chunk* free_[SIZE_CLASS_COUNT] = {};
+};
+
+struct source_key {
+  dnsfwd::server* server;
+  boost::asio::generic::datagram_protocol::endpoint endpoint;
+  bool operator==(source_key const& that) const
+  {
+    return server == that.server && endpoint == that.endpoint;
+  }
+};
+
+struct source_hash {
+  std::size_t operator()(source_key const& key) const
+  {
+    const unsigned char* p = (const unsigned char*) key.endpoint.data();
+    std::uint64_t hash = 0xcbf29ce484222325 ^ (std::uintptr_t) key.server;
+    for (std::size_t i = 0; i != key.endpoint.size(); ++i)
+      hash = (hash ^ p[i]) * 0x100000001b3;
+    return hash;
+  }
+};
+
+// Sources of the requests in flight, shared by the requests of a client:
+class source_table {
+public:
+  std::uint32_t acquire(dnsfwd::server& server,
+    boost::asio::generic::datagram_protocol::endpoint const& endpoint)
+  {
+    source_key key = { &server, endpoint };
+    auto i = index_.find(key);
+    if (i != index_.end()) {
+      entries_[i->second].references++;
+      return i->second;
+    }
+    std::uint32_t index;
+    if (free_.empty()) {
+      index = entries_.size();
+      entries_.push_back(entry());
+    } else {
+      index = free_.back();
+      free_.pop_back();
+    }
+    entries_[index].key = key;
+    entries_[index].references = 1;
+    index_.insert(std::make_pair(key, index));
+    return index;
+  }
+  void release(std::uint32_t index)
+  {
+    entry& e = entries_[index];
+    if (--e.references != 0)
+      return;
+    index_.erase(e.key);
+    free_.push_back(index);
+  }
+  source_key const& get(std::uint32_t index) const
+  {
+    return entries_[index].key;
+  }
+private:
+  struct entry {
+    source_key key;
+    std::uint32_t references;
+  };
+  std::vector<entry> entries_;
+  std::vector<std::uint32_t> free_;
+  std::unordered_map<source_key, std::uint32_t, source_hash> index_;
+};
+
+slab_allocator& slabs()
+{
+  static slab_allocator allocator;
+  return allocator;
+}
+
+source_table& sources()
+{
+  static source_table table;
+  return table;
+}
+
+}
+
+message::message(dnsfwd::server& server,
+    boost::asio::generic::datagram_protocol::endpoint const& source,
+    const char* data, std::size_t size, bool sampled)
+  : client_id_(0), server_id_(0), timestamp_(message_clock()),
+    source_(sources().acquire(server, source)),
+    size_(size), sampled_(sampled)
+{
+  std::size_t prefix = sampled ? sizeof(query_trace) : 0;
+  size_class_ = slabs().size_class(prefix + sizeof(std::uint16_t) + size);
+  payload_ = static_cast<char*>(slabs().allocate(size_class_)) + prefix;
+  if (sampled) {
+    new (this->trace()) query_trace();
+    this->mark(&query_trace::received);
+  }
+  payload_[0] = size >> 8;
+  payload_[1] = size;
+  std::memcpy(payload_ + sizeof(std::uint16_t), data, size);
+  server.pending_++;
+}
+
+message::~message()
+{
+  // The server is not destroyed before its requests:
+  this->server().pending_--;
+  sources().release(source_);
+  slabs().deallocate(size_class_,
+    sampled_ ? payload_ - sizeof(query_trace) : payload_);
+}
+
+void* message::operator new(std::size_t size)
+{
+  return slabs().allocate(slabs().size_class(size));
+}
+
+void message::operator delete(void* pointer)
+{
+  slabs().deallocate(slabs().size_class(sizeof(message)), pointer);
+}
+
+dnsfwd::server& message::server() const
+{
+  return *sources().get(source_).server;
+}
+
+boost::asio::generic::datagram_protocol::endpoint const& message::source() const
+{
+  return sources().get(source_).endpoint;
+}
+
+}
@@ -0,0 +1,46 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DNSFWD_PROBES_HPP
+#define DNSFWD_PROBES_HPP
+
+// Static tracepoints of the request processing for bpftrace, perf or
+// SystemTap (see the probes directory). They are only built with USE_SDT and
+// cost a nop each when they are not traced. The message IDs are passed in
+// host byte order and the requests are identified by their address.
+
+#ifdef USE_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(dnsfwd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(dnsfwd, name, a, b, c)
+
+#else
+
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+
+#endif
+
+#endif
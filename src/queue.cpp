@@ -0,0 +1,120 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+namespace dnsfwd {
+
+namespace {
+
+// Number of flows of a queue. Clients hashed to the same flow share it.
+const std::size_t FLOW_COUNT = 1024;
+// Bytes credited to a flow at each round:
+const std::size_t QUANTUM = 512;
+
+std::uint64_t hash_bytes(std::uint64_t hash, const void* data, std::size_t size)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (std::size_t i = 0; i != size; ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+}
+
+fair_queue::fair_queue() : size_(0) {}
+
+fair_queue::~fair_queue()
+{
+  active_.clear();
+  if (flows_)
+    for (std::size_t i = 0; i != FLOW_COUNT; ++i)
+      flows_[i].queue.clear_and_dispose(deleter());
+}
+
+// The flow of a request depends on the client address (but not on its port)
+// and on the server socket:
+fair_queue::flow& fair_queue::flow_of(message const& request)
+{
+  dnsfwd::server* server = &request.server();
+  std::uint64_t hash = hash_bytes(NAME_HASH_SEED, &server, sizeof(server));
+  const sockaddr* address = (const sockaddr*) request.source().data();
+  if (address->sa_family == AF_INET) {
+    const sockaddr_in* in = (const sockaddr_in*) address;
+    hash = hash_bytes(hash, &in->sin_addr, sizeof(in->sin_addr));
+  } else if (address->sa_family == AF_INET6) {
+    const sockaddr_in6* in6 = (const sockaddr_in6*) address;
+    hash = hash_bytes(hash, &in6->sin6_addr, sizeof(in6->sin6_addr));
+  } else {
+    hash = hash_bytes(hash, address, request.source().size());
+  }
+  return flows_[hash % FLOW_COUNT];
+}
+
+bool fair_queue::push(message& request, std::size_t limit)
+{
+  if (!flows_)
+    flows_.reset(new flow[FLOW_COUNT]);
+  flow& f = this->flow_of(request);
+  if (limit && f.queue.size() >= limit)
+    return false;
+  if (f.queue.empty())
+    active_.push_back(f);
+  f.queue.push_back(request);
+  size_++;
+  return true;
+}
+
+message* fair_queue::pop()
+{
+  while (!active_.empty()) {
+    flow& f = active_.front();
+    message& request = f.queue.front();
+    // Not enough credit left, give the turn to the next flow:
+    if (f.deficit < request.size()) {
+      f.deficit += QUANTUM;
+      active_.pop_front();
+      active_.push_back(f);
+      continue;
+    }
+    f.deficit -= request.size();
+    f.queue.pop_front();
+    if (f.queue.empty()) {
+      f.deficit = 0;
+      active_.pop_front();
+    }
+    size_--;
+    return &request;
+  }
+  return nullptr;
+}
+
+}
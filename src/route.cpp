@@ -0,0 +1,128 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace dnsfwd {
+
+suffix_table::suffix_table()
+  : entries_(16), count_(0)
+{
+}
+
+void suffix_table::insert(std::string const& name, int value)
+{
+  std::string wire;
+  if (!wire_name(name, wire)) {
+    LOG(ERR) << "Invalid domain name " << name << "\n";
+    std::exit(1);
+  }
+  std::uint64_t hash = hash_name(wire.data(), wire.size());
+
+  std::size_t i = this->slot(hash, wire.data(), wire.size());
+  if (entries_[i].size != 0) {
+    entries_[i].value = value;
+    return;
+  }
+
+  if (2 * (count_ + 1) > entries_.size()) {
+    this->grow();
+    i = this->slot(hash, wire.data(), wire.size());
+  }
+  entry& e = entries_[i];
+  e.hash = hash;
+  e.offset = names_.size();
+  e.size = wire.size();
+  e.value = value;
+  names_ += wire;
+  count_++;
+}
+
+void suffix_table::grow()
+{
+  std::vector<entry> entries(2 * entries_.size());
+  entries.swap(entries_);
+  std::size_t mask = entries_.size() - 1;
+  for (entry const& e : entries) {
+    if (e.size == 0)
+      continue;
+    std::size_t i = e.hash & mask;
+    while (entries_[i].size != 0)
+      i = (i + 1) & mask;
+    entries_[i] = e;
+  }
+}
+
+// Slot of the given suffix or of the free slot where it would be inserted:
+std::size_t suffix_table::slot(
+  std::uint64_t hash, const char* name, std::size_t size) const
+{
+  std::size_t mask = entries_.size() - 1;
+  std::size_t i = hash & mask;
+  while (1) {
+    entry const& e = entries_[i];
+    if (e.size == 0)
+      return i;
+    if (e.hash == hash && e.size == size
+        && same_name(names_.data() + e.offset, name, size))
+      return i;
+    i = (i + 1) & mask;
+  }
+}
+
+// Find the value associated with the longest suffix of a wire format name
+// (as found in a question): the suffixes are hashed label by label from the
+// root so each suffix costs a single probe.
+int suffix_table::find(const char* name, std::size_t size) const
+{
+  if (count_ == 0)
+    return -1;
+
+  std::uint8_t labels[MAX_LABELS];
+  std::size_t count = 0;
+  for (std::size_t pos = 0; pos < size && name[pos] != 0;
+      pos += (std::uint8_t) name[pos] + 1) {
+    if (count == MAX_LABELS)
+      return -1;
+    labels[count++] = pos;
+  }
+
+  int res = -1;
+  std::uint64_t hash = NAME_HASH_SEED;
+  for (std::size_t i = count; i != 0; --i) {
+    std::size_t start = labels[i - 1];
+    hash = hash_label(hash, name + start);
+    // The stored suffixes do not include the root label:
+    entry const& e = entries_[this->slot(hash, name + start, size - 1 - start)];
+    if (e.size != 0)
+      res = e.value;
+  }
+  return res;
+}
+
+}
@@ -22,8 +22,11 @@ THE SOFTWARE.
 */
 
 #include "dnsfwd.hpp"
+#include "probes.hpp"
 
 #include <utility>
+#include <array>
+#include <cstring>
 #include <memory>
 #include <iostream>
 
@@ -86,8 +89,11 @@ boost::asio::generic::datagram_protocol datagram_protocol_from_socket(int fd)
 server::server(boost::asio::io_service& io_service, service& service, int socket)
   : service_(&service),
     socket_(io_service, datagram_protocol_from_socket(socket), socket),
-    context_(nullptr)
+    buffer_(MAX_QUERY_SIZE),
+    pending_(0),
+    stopped_(false)
 {
+  socket_.non_blocking(true);
   start_receive();
 }
 
@@ -99,70 +105,140 @@ server::server(boost::asio::io_service& io_service, service& service,
         udp_endpoint.udp_endpoint(io_service, "domain")
       )
     ),
-    context_(nullptr)
+    buffer_(MAX_QUERY_SIZE),
+    pending_(0),
+    stopped_(false)
 {
+  socket_.non_blocking(true);
   start_receive();
 }
 
 void server::start_receive()
 {
-  if (!context_)
-    context_ = std::unique_ptr<message>(new message());
   socket_.async_receive_from(
-    boost::asio::buffer(
-      context_->buffer_.data(),
-      context_->buffer_.size()),
-    context_->endpoint_,
-    boost::bind(
-      &server::on_message,
-      this,
-      boost::asio::placeholders::error,
-      boost::asio::placeholders::bytes_transferred)
+    boost::asio::buffer(buffer_.data(), buffer_.size()),
+    sender_,
+    make_allocated_handler(receive_memory_,
+      boost::bind(
+        &server::on_message,
+        this,
+        boost::asio::placeholders::error,
+        boost::asio::placeholders::bytes_transferred))
   );
 }
 
 void server::on_message(const boost::system::error_code& error, std::size_t size)
 {
-  if (error) {
+  if (error == boost::asio::error::operation_aborted && stopped_) {
+    return;
+  } else if (error) {
     LOG(ERR) << "Request reception error: " << error << '\n';
   } else if (size < MIN_MESSAGE_SIZE) {
     LOG(DEBUG) << "Request is too small (" << size << " bytes)\n";
+  } else if (!this->valid_request(size)) {
+    LOG(DEBUG) << "Request is not a valid query\n";
   } else {
-    LOG(DEBUG) << "Request received\n";
-    context_->size_ = size;
-    context_->server_ = this;
-    service_->add_request(context_);
+    LOG(DEBUG) << "Request received on CPU " << incoming_cpu() << "\n";
+    std::unique_ptr<message> context(
+      new message(*this, sender_, buffer_.data(), size, service_->sample()));
+    PROBE3(query__received, context.get(), ntohs(context->id()), size);
+    service_->add_request(context);
   }
-  start_receive();
+  if (!stopped_)
+    start_receive();
 }
 
-void server::send_response(
-  std::vector<char> response,
-  boost::asio::generic::datagram_protocol::endpoint endpoint)
+bool server::valid_request(std::size_t size)
 {
-  auto buffer = boost::asio::buffer(response.data(), response.size());
+  message_view request;
+  return request.parse(buffer_.data(), size) && !request.qr();
+}
+
+// CPU which processed the last received packet in the kernel (-1 if unknown):
+int server::incoming_cpu()
+{
+#ifdef HAVE_SO_INCOMING_CPU
+  int cpu;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(socket_.native_handle(), SOL_SOCKET, SO_INCOMING_CPU,
+      &cpu, &len) == 0)
+    return cpu;
+#endif
+  return -1;
+}
+
+void server::stop()
+{
+  // Stop receiving queries but keep the socket open in order to send the
+  // responses of the requests in flight:
+  stopped_ = true;
+  boost::system::error_code ec;
+  socket_.cancel(ec);
+}
+
+// Send a response to a request with its message ID. The datagram is sent
+// immediately (without copy) unless the socket buffer is full:
+void server::send_response(message const& request, const char* data,
+  std::size_t size)
+{
+  std::uint16_t id = request.server_id_;
+  boost::asio::generic::datagram_protocol::endpoint const& endpoint =
+    request.source();
+  std::array<boost::asio::const_buffer, 2> buffers = {{
+    boost::asio::buffer(&id, sizeof(id)),
+    boost::asio::buffer(data + sizeof(id), size - sizeof(id))
+  }};
+  boost::system::error_code error;
+  std::size_t sent = socket_.send_to(buffers, endpoint, 0, error);
+  if (error != boost::asio::error::would_block) {
+    if (error) {
+      LOG(ERR) << "Error forwarding response\n";
+    } else if (sent != size) {
+      LOG(ERR) << "Response forward incomplete " << sent << " " << size << '\n';
+    } else {
+      LOG(DEBUG) << "Response sent\n";
+      PROBE3(reply__sent, &request, ntohs(id), size);
+    }
+    return;
+  }
+
+  // The handler is copied by bind and asio: the buffer must not move with it.
+  std::shared_ptr<std::vector<char>> response =
+    std::make_shared<std::vector<char>>(data, data + size);
+  std::memcpy(response->data(), &id, sizeof(id));
+  auto buffer = boost::asio::buffer(response->data(), response->size());
+  pending_++;
   socket_.async_send_to(
     buffer,
     endpoint,
     boost::bind(
       &server::response_sent,
       this,
-      std::move(response),
+      response,
+      // Only identifies the request in the probe, which is deleted by then:
+      static_cast<const void*>(&request),
       boost::asio::placeholders::error,
       boost::asio::placeholders::bytes_transferred
     )
   );
 }
 
-void server::response_sent(std::vector<char>& response,
-  const boost::system::error_code& error, std::size_t size)
+void server::response_sent(std::shared_ptr<std::vector<char>> const& response,
+  const void* request, const boost::system::error_code& error,
+  std::size_t size)
 {
+  pending_--;
+  // Only used by the probe:
+  (void) request;
   if (error) {
     LOG(ERR) << "Error forwarding response\n";
-  } else if (size != response.size()) {
-    LOG(ERR) << "Response forward incomplete " << size << " " << response.size() << '\n';
+  } else if (size != response->size()) {
+    LOG(ERR) << "Response forward incomplete " << size << " " << response->size() << '\n';
   } else {
     LOG(DEBUG) << "Response sent\n";
+    std::uint16_t id;
+    std::memcpy(&id, response->data(), sizeof(id));
+    PROBE3(reply__sent, request, ntohs(id), size);
   }
 }
 
@@ -22,10 +22,23 @@ THE SOFTWARE.
 */
 
 #include "dnsfwd.hpp"
+#include "probes.hpp"
 
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include <cerrno>
 #include <ctime>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <boost/asio/io_service.hpp>
 
@@ -37,11 +50,42 @@ THE SOFTWARE.
 
 namespace dnsfwd {
 
+namespace {
+
+// Report the errno to the parent of a handoff child which cannot execute
+// the new program:
+[[noreturn]] void exec_failed(int notify)
+{
+  int error = errno;
+  if (notify >= 0)
+    while (write(notify, &error, sizeof(error)) < 0 && errno == EINTR) {}
+  _exit(127);
+}
+
+// The simulations are reproducible:
+std::uint32_t random_seed()
+{
+#ifdef DNSFWD_SIMULATION
+  return 1;
+#else
+  return std::time(nullptr);
+#endif
+}
+
+}
+
 service::service(boost::asio::io_service& io_service, dnsfwd::config config)
   : io_service_(&io_service),
     config_(std::move(config)),
-    random_(std::time(nullptr))
+    retire_timer_(io_service),
+    random_(random_seed()),
+    signals_(io_service, SIGUSR2, SIGUSR1, SIGHUP),
+    drain_timer_(io_service),
+    slow_queries_(config_.trace_slow),
+    trace_count_(0)
 {
+  this->setup_upstreams(config_);
+
   // TODO, multiple server objects
   for(std::size_t i = 0; i < config_.listen_fds; ++i) {
     servers_.push_back(std::unique_ptr<server>(
@@ -54,38 +98,530 @@ service::service(boost::asio::io_service& io_service, dnsfwd::config config)
       new server(io_service, *this, endpoint)
     ));
   }
+
+  if (!config_.blocklist.empty()) {
+    clock_type::time_point start = clock_type::now();
+    blocklist_ = std::make_shared<blocklist>(config_.blocklist);
+    LOG(INFO) << "Blocklist loaded: " << blocklist_->size() << " names in "
+      << std::chrono::duration_cast<std::chrono::microseconds>(
+        clock_type::now() - start).count() << "us\n";
+  }
+
+  // Connect to the upstream before the first query arrives so that the
+  // queries following a restart do not pay for the connection setup:
+  io_service.post(boost::bind(&service::connect_all, this));
+
+  signals_.async_wait(boost::bind(&service::on_signal, this,
+    boost::asio::placeholders::error,
+    boost::asio::placeholders::signal_number));
+}
+
+void service::on_signal(const boost::system::error_code& error, int signal_number)
+{
+  if (error)
+    return;
+  if (signal_number == SIGUSR2 && this->handoff())
+    return;
+  if (signal_number == SIGUSR1)
+    slow_queries_.dump();
+  if (signal_number == SIGHUP)
+    this->reload();
+  signals_.async_wait(boost::bind(&service::on_signal, this,
+    boost::asio::placeholders::error,
+    boost::asio::placeholders::signal_number));
+}
+
+// Execute a new instance of the program, passing it the UDP sockets using the
+// socket activation protocol. Once the new program is executed, we stop
+// receiving queries but the requests in flight are still answered on the
+// shared sockets before exiting. If it cannot be executed, we keep serving.
+bool service::handoff()
+{
+  LOG(NOTICE) << "Handing off the sockets to a new process\n";
+
+  if (config_.args.empty()) {
+    LOG(ERR) << "Cannot hand off: unknown command line\n";
+    return false;
+  }
+
+  std::vector<int> fds;
+  for (std::unique_ptr<server> const& server : servers_)
+    fds.push_back(server->native_handle());
+  int count = fds.size();
+
+  // The child reports the errno of a failure on this pipe, which is closed
+  // without data by a successful exec:
+  int status[2];
+  if (pipe2(status, O_CLOEXEC) != 0) {
+    LOG(ERR) << "Cannot hand off: could not create a pipe\n";
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG(ERR) << "Cannot hand off: could not fork\n";
+    close(status[0]);
+    close(status[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    // Move the sockets and the status pipe out of the way and then the
+    // sockets in place:
+    for (int& fd : fds)
+      fd = fcntl(fd, F_DUPFD, SD_LISTEN_FDS_START + count);
+    int notify = fcntl(status[1], F_DUPFD_CLOEXEC, SD_LISTEN_FDS_START + count);
+    for (int i = 0; i < count; ++i)
+      if (fds[i] < 0 || notify < 0 || dup2(fds[i], SD_LISTEN_FDS_START + i) < 0)
+        exec_failed(notify);
+    // Do not leak the upstream connection or any other file descriptor:
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (long fd = SD_LISTEN_FDS_START + count; fd < max_fd; ++fd)
+      if (fd != notify)
+        close(fd);
+
+    setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+    setenv("LISTEN_FDS", std::to_string(count).c_str(), 1);
+    unsetenv("LISTEN_FDNAMES");
+    setenv("DNSFWD_HANDOFF", "1", 1);
+
+    std::vector<char*> argv;
+    for (std::string& arg : config_.args)
+      argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    execvp(argv[0], argv.data());
+    exec_failed(notify);
+  }
+
+  close(status[1]);
+  int error = 0;
+  ssize_t size;
+  do
+    size = read(status[0], &error, sizeof(error));
+  while (size < 0 && errno == EINTR);
+  close(status[0]);
+  if (size != 0) {
+    LOG(ERR) << "Cannot hand off: could not execute " << config_.args[0]
+      << ": " << std::strerror(error) << "\n";
+    waitpid(pid, nullptr, 0);
+    return false;
+  }
+
+  LOG(NOTICE) << "New process " << pid << " started\n";
+  for (std::unique_ptr<server> const& server : servers_)
+    server->stop();
+  signals_.cancel();
+
+  drain_deadline_ = clock_type::now() + this->time_to_live();
+  drain_timer_.expires_from_now(std::chrono::milliseconds(100));
+  drain_timer_.async_wait(boost::bind(&service::on_drain_timer, this,
+    boost::asio::placeholders::error));
+  return true;
+}
+
+void service::on_drain_timer(const boost::system::error_code& error)
+{
+  if (error)
+    return;
+  bool idle = true;
+  for (std::unique_ptr<upstream> const& upstream : upstreams_)
+    idle = idle && upstream->queue.empty()
+      && (!upstream->client || upstream->client->idle());
+  if (idle || clock_type::now() >= drain_deadline_) {
+    LOG(NOTICE) << "Requests drained, exiting\n";
+    io_service_->stop();
+    return;
+  }
+  drain_timer_.expires_from_now(std::chrono::milliseconds(100));
+  drain_timer_.async_wait(boost::bind(&service::on_drain_timer, this,
+    boost::asio::placeholders::error));
+}
+
+// Apply a new configuration without losing the established connections and
+// the requests in flight. The sockets and upstreams which are not in the new
+// configuration are retired: they answer their pending requests and are
+// destroyed afterwards.
+void service::reload()
+{
+  dnsfwd::config config = config_;
+  if (!reload_config(config))
+    return;
+  LOG(NOTICE) << "Reloading the configuration\n";
+
+  std::shared_ptr<dnsfwd::blocklist> blocklist;
+  if (!config.blocklist.empty()) {
+    try {
+      blocklist = std::make_shared<dnsfwd::blocklist>(config.blocklist);
+    }
+    catch (std::exception& e) {
+      LOG(ERR) << "Configuration not reloaded: " << e.what() << "\n";
+      return;
+    }
+    LOG(INFO) << "Blocklist loaded: " << blocklist->size() << " names\n";
+  }
+
+  // The sockets inherited from the previous process are always kept (we do
+  // not know their configuration) and the others are kept when they are
+  // bound to an address of the new configuration. The kept sockets stay in
+  // front of the new ones so that the inherited ones remain the first
+  // listen_fds servers across reloads:
+  std::vector<bool> keep(servers_.size(), false);
+  std::vector<std::unique_ptr<server>> servers;
+  for (std::size_t i = 0; i < servers_.size(); ++i)
+    keep[i] = i < (std::size_t) config_.listen_fds;
+  std::vector<std::unique_ptr<server>> added;
+  for (dnsfwd::endpoint const& endpoint : config.bind_udp) {
+    try {
+      boost::asio::generic::datagram_protocol::endpoint local(
+        endpoint.udp_endpoint(*io_service_, "domain"));
+      bool found = false;
+      for (std::size_t i = 0; i < servers_.size(); ++i)
+        if (servers_[i]->local_endpoint() == local) {
+          keep[i] = true;
+          found = true;
+        }
+      if (!found)
+        added.push_back(std::unique_ptr<server>(
+          new server(*io_service_, *this, endpoint)));
+    }
+    catch (std::exception& e) {
+      LOG(ERR) << "Could not bind " << endpoint.name << ": " << e.what() << "\n";
+    }
+  }
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    if (keep[i]) {
+      servers.push_back(std::move(servers_[i]));
+    } else {
+      servers_[i]->stop();
+      retired_servers_.push_back(std::move(servers_[i]));
+    }
+  }
+  for (std::unique_ptr<server>& server : added)
+    servers.push_back(std::move(server));
+  servers_ = std::move(servers);
+
+  this->setup_upstreams(config);
+
+  blocklist_ = blocklist;
+  if (config.trace_slow != config_.trace_slow)
+    slow_queries_ = slow_queries(config.trace_slow);
+  config_ = std::move(config);
+  if (!config_.health_interval)
+    for (std::unique_ptr<upstream> const& upstream : upstreams_) {
+      upstream->failures = 0;
+      upstream->down = false;
+      upstream->admitted = 0;
+    }
+
+  LOG(INFO) << servers_.size() << " sockets, " << upstreams_.size()
+    << " upstreams, " << retired_servers_.size() << " sockets and "
+    << retired_upstreams_.size() << " upstreams retired\n";
+  this->connect_all();
+  if (!retired_servers_.empty() || !retired_upstreams_.empty()) {
+    retire_timer_.expires_from_now(std::chrono::seconds(1));
+    retire_timer_.async_wait(boost::bind(&service::on_retire_timer, this,
+      boost::asio::placeholders::error));
+  }
+}
+
+// Create the upstreams of a configuration. The current upstreams with the
+// same endpoints are kept with their connections and the others retired.
+void service::setup_upstreams(dnsfwd::config const& config)
+{
+  // The routes of a domain written with different cases are merged, as
+  // the suffix table ignores the case:
+  std::vector<dnsfwd::route> merged;
+  for (dnsfwd::route const& route : config.routes) {
+    auto i = std::find_if(merged.begin(), merged.end(),
+      [&route](dnsfwd::route const& other) {
+        return same_domain(other.domain, route.domain);
+      });
+    if (i == merged.end())
+      merged.push_back(route);
+    else
+      i->connect_tcp.insert(i->connect_tcp.end(),
+        route.connect_tcp.begin(), route.connect_tcp.end());
+  }
+
+  std::vector<std::unique_ptr<upstream>> upstreams;
+  suffix_table routes;
+  upstreams.push_back(this->take_upstream(config.connect_tcp));
+  for (dnsfwd::route const& route : merged) {
+    routes.insert(route.domain, upstreams.size());
+    upstreams.push_back(this->take_upstream(route.connect_tcp));
+  }
+  for (std::unique_ptr<upstream>& upstream : upstreams_)
+    if (upstream)
+      this->retire(std::move(upstream));
+  upstreams_ = std::move(upstreams);
+  routes_ = std::move(routes);
+}
+
+std::unique_ptr<dnsfwd::upstream> service::take_upstream(
+  std::vector<endpoint> const& connect_tcp)
+{
+  for (std::unique_ptr<upstream>& upstream : upstreams_)
+    if (upstream && upstream->connect_tcp == connect_tcp)
+      return std::move(upstream);
+  std::unique_ptr<upstream> upstream(new dnsfwd::upstream());
+  upstream->connect_tcp = connect_tcp;
+  return upstream;
+}
+
+// Stop using an upstream but let its active connection answer the pending
+// requests:
+void service::retire(std::unique_ptr<dnsfwd::upstream> upstream)
+{
+  upstream->retired = true;
+  upstream->deadline = clock_type::now() + this->time_to_live();
+  std::vector<std::shared_ptr<client>> standby = std::move(upstream->standby);
+  upstream->standby.clear();
+  for (std::shared_ptr<client> const& client : standby)
+    client->stop();
+  retired_upstreams_.push_back(std::move(upstream));
+}
+
+void service::on_retire_timer(const boost::system::error_code& error)
+{
+  if (error)
+    return;
+  clock_type::time_point now = clock_type::now();
+
+  for (auto i = retired_upstreams_.begin(); i != retired_upstreams_.end();) {
+    upstream& upstream = **i;
+    bool idle = upstream.queue.empty()
+      && (!upstream.client || upstream.client->idle());
+    if (!idle && now < upstream.deadline) {
+      ++i;
+      continue;
+    }
+    if (upstream.client) {
+      std::shared_ptr<client> client = std::move(upstream.client);
+      upstream.client = nullptr;
+      client->stop();
+    }
+    LOG(INFO) << "Retired upstream closed\n";
+    i = retired_upstreams_.erase(i);
+  }
+
+  for (auto i = retired_servers_.begin(); i != retired_servers_.end();) {
+    if ((*i)->idle()) {
+      LOG(INFO) << "Retired socket closed\n";
+      i = retired_servers_.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  if (retired_servers_.empty() && retired_upstreams_.empty())
+    return;
+  retire_timer_.expires_from_now(std::chrono::seconds(1));
+  retire_timer_.async_wait(boost::bind(&service::on_retire_timer, this,
+    boost::asio::placeholders::error));
+}
+
+void service::connect_all()
+{
+  for (std::unique_ptr<upstream> const& upstream : upstreams_)
+    this->connect(*upstream);
+}
+
+std::shared_ptr<client> service::make_client(dnsfwd::upstream& upstream)
+{
+  if (upstream.connect_tcp.at(0).path.empty())
+    return std::make_shared<client>(*io_service_, *this, upstream);
+  else
+    return std::make_shared<http2_client>(*io_service_, *this, upstream);
+}
+
+void service::connect(dnsfwd::upstream& upstream)
+{
+  if (upstream.client || upstream.retired)
+    return;
+  // Wait for the retry time while the circuit breaker is open:
+  if (upstream.down && clock_type::now() < upstream.retry)
+    return;
+  auto i = std::find_if(upstream.standby.rbegin(), upstream.standby.rend(),
+    [](std::shared_ptr<client> const& client) {
+      return !client->connecting();
+    });
+  if (i != upstream.standby.rend()) {
+    LOG(INFO) << "Using a standby connection\n";
+    upstream.client = *i;
+    upstream.standby.erase(std::next(i).base());
+    upstream.client->send();
+  } else {
+    // Its failure is reported by the client:
+    upstream.client = this->make_client(upstream);
+    upstream.client->connect();
+  }
+  this->fill_standby(upstream);
+}
+
+// The standby connections are established in the background:
+void service::fill_standby(dnsfwd::upstream& upstream)
+{
+  while (!upstream.retired && !upstream.down
+      && upstream.standby.size() < config_.standby) {
+    std::shared_ptr<client> client = this->make_client(upstream);
+    upstream.standby.push_back(client);
+    client->connect();
+  }
+}
+
+dnsfwd::upstream& service::route(message_view const& request)
+{
+  if (routes_.size() != 0 && request.qname()) {
+    int i = routes_.find(request.qname(), request.qname_size());
+    if (i >= 0)
+      return *upstreams_[i];
+  }
+  return *upstreams_[0];
+}
+
+// Answer locally the queries for blocked names:
+bool service::block(std::unique_ptr<message>& context, message_view const& request)
+{
+  if (!blocklist_ || !request.qname()
+      || !blocklist_->contains(request.qname(), request.qname_size()))
+    return false;
+
+  LOG(DEBUG) << "Request blocked\n";
+  // Room for the question and a null address:
+  char response[MAX_QUERY_SIZE + 32];
+  std::memcpy(response, context->data(), request.question_end());
+  std::size_t size = blocked_response(response, request, config_.blocklist_null);
+  context->server().send_response(*context, response, size);
+  context.reset();
+  return true;
+}
+
+// Answer SERVFAIL at once instead of holding a query for an upstream which is
+// down:
+void service::fail(std::unique_ptr<message> context)
+{
+  message_view request;
+  request.parse(context->data(), context->size());
+  char response[MAX_QUERY_SIZE];
+  std::memcpy(response, context->data(), request.question_end());
+  std::size_t size = error_response(response, request, RCODE_SERVFAIL);
+  context->server().send_response(*context, response, size);
+}
+
+// Circuit breaker: after too many failures, the connections of the upstream
+// are closed and its queries are failed until the retry time. A failure
+// while recovering opens it again at once.
+void service::upstream_failed(dnsfwd::upstream& upstream)
+{
+  if (!config_.health_interval || upstream.retired)
+    return;
+  if (++upstream.failures < MAX_HEALTH_FAILURES && !upstream.down)
+    return;
+  if (!upstream.down)
+    LOG(WARNING) << "Upstream " << upstream.connect_tcp.at(0).name
+      << " is down\n";
+  upstream.down = true;
+  upstream.admitted = 0;
+  upstream.retry = clock_type::now()
+    + std::chrono::seconds(config_.health_interval);
+
+  std::vector<std::shared_ptr<client>> clients = std::move(upstream.standby);
+  upstream.standby.clear();
+  if (upstream.client) {
+    clients.push_back(std::move(upstream.client));
+    upstream.client = nullptr;
+  }
+  for (std::shared_ptr<client> const& client : clients) {
+    client->fail_requests();
+    client->stop();
+  }
+  while (std::unique_ptr<message> context = this->unqueue(upstream))
+    this->fail(std::move(context));
+}
+
+// Readmit the traffic progressively once an upstream answers again:
+void service::upstream_healthy(dnsfwd::upstream& upstream)
+{
+  upstream.failures = 0;
+  if (!upstream.down)
+    return;
+  LOG(NOTICE) << "Upstream " << upstream.connect_tcp.at(0).name
+    << " is up\n";
+  upstream.down = false;
+  upstream.admitted = RECOVERY_ADMISSION;
+  this->fill_standby(upstream);
 }
 
 void service::add_request(std::unique_ptr<message>& context)
 {
   context->server_id_ = context->id();
 
-  if (!client_) {
-    client_ = std::make_shared<client>(*io_service_, *this);
-    client_->connect();
+  // The request has already been validated by the server:
+  message_view request;
+  request.parse(context->data(), context->size());
+  if (this->block(context, request))
+    return;
+
+  dnsfwd::upstream& upstream = this->route(request);
+  this->connect(upstream);
+  if (upstream.down) {
+    this->fail(std::move(context));
+    return;
   }
 
-  if (!client_->add_request(context)) {
-    this->queue_.push_back(*context);
+  // The request is handed to the connection directly only when no other
+  // request is waiting:
+  if (upstream.client && upstream.queue.empty()
+      && upstream.client->add_request(context))
+    return;
+  if (upstream.queue.push(*context, config_.flow_queue)) {
+    PROBE2(query__enqueued, context.get(), upstream.queue.size());
     context.release();
+  } else {
+    LOG(DEBUG) << "Queue of the client full, request dropped\n";
+    PROBE2(request__dropped, context.get(), ntohs(context->id()));
+    context.reset();
   }
+  // The connection may take a request or make room by expiring its old ones:
+  if (upstream.client)
+    upstream.client->send();
 }
 
-std::unique_ptr<message> service::unqueue()
+std::unique_ptr<message> service::unqueue(dnsfwd::upstream& upstream)
 {
-  if (queue_.empty()) {
-    return nullptr;
-  } else {
-    message& c = queue_.front();
-    queue_.pop_front();
-    return std::unique_ptr<message>(&c);
+  // The requests which waited longer than their time to live are dropped:
+  message_time expired = message_clock() - this->time_to_live().count() * 1000;
+  while (message* request = upstream.queue.pop()) {
+    std::unique_ptr<message> context(request);
+    if (after(context->timestamp_, expired))
+      return context;
+    PROBE2(query__expired, request, ntohs(request->id()));
   }
+  return nullptr;
 }
 
 void service::unregister(std::shared_ptr<client> client)
 {
-  if (client == client_) {
-    client_ = nullptr;
+  dnsfwd::upstream& upstream = client->upstream();
+  if (client == upstream.client) {
+    upstream.client = nullptr;
+    // Replace it at once if we have an established standby connection:
+    bool standby = std::any_of(upstream.standby.begin(), upstream.standby.end(),
+      [](std::shared_ptr<dnsfwd::client> const& client) {
+        return !client->connecting();
+      });
+    if (standby && !upstream.retired)
+      this->connect(upstream);
+  } else {
+    auto i = std::find(upstream.standby.begin(), upstream.standby.end(), client);
+    if (i != upstream.standby.end()) {
+      upstream.standby.erase(i);
+      // Do not retry now if the upstream is not reachable:
+      if (!client->connecting()) {
+        LOG(INFO) << "Standby connection lost\n";
+        this->fill_standby(upstream);
+      }
+    }
   }
 }
 
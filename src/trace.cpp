@@ -0,0 +1,92 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "dnsfwd.hpp"
+
+#include <algorithm>
+
+namespace dnsfwd {
+
+namespace {
+
+long long microseconds(clock_type::time_point from,
+  clock_type::time_point to)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+}
+
+slow_queries::slow_queries(std::size_t capacity)
+  : capacity_(capacity)
+{
+  entries_.reserve(capacity);
+}
+
+void slow_queries::add(message const& query)
+{
+  if (capacity_ == 0)
+    return;
+  query_trace const& trace = *query.trace();
+  clock_type::duration total = trace.sent - trace.received;
+  if (entries_.size() == capacity_) {
+    // Replace the fastest query if this one is slower:
+    if (total <= entries_.front().total)
+      return;
+    std::pop_heap(entries_.begin(), entries_.end(), slower());
+    entries_.pop_back();
+  }
+
+  message_view request;
+  if (!request.parse(query.data(), query.size()))
+    return;
+  entry e;
+  e.total = total;
+  e.trace = trace;
+  e.qtype = request.qtype();
+  e.name_size = 0;
+  if (request.qname()) {
+    e.name_size = request.qname_size();
+    std::memcpy(e.name, request.qname(), request.qname_size());
+  }
+  entries_.push_back(e);
+  std::push_heap(entries_.begin(), entries_.end(), slower());
+}
+
+void slow_queries::dump() const
+{
+  std::vector<entry> entries = entries_;
+  std::sort_heap(entries.begin(), entries.end(), slower());
+  LOG(NOTICE) << entries.size() << " slowest queries:\n";
+  for (entry const& e : entries) {
+    query_trace const& t = e.trace;
+    LOG(NOTICE) << text_name(e.name, e.name_size) << " type " << e.qtype
+      << ": " << microseconds(t.received, t.sent) << "us"
+      << " (queue " << microseconds(t.received, t.dequeued) << "us"
+      << ", write " << microseconds(t.dequeued, t.written) << "us"
+      << ", upstream " << microseconds(t.written, t.replied) << "us"
+      << ", send " << microseconds(t.replied, t.sent) << "us)\n";
+  }
+}
+
+}
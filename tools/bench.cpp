@@ -0,0 +1,502 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Micro and service benchmarks of dnsfwd. Each benchmark prints its result
+// on a single line. The service benchmarks run the service on the main
+// thread against a local DNS/TCP upstream and UDP clients running in other
+// threads of the process.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/program_options.hpp>
+
+#include "dnsfwd.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+// Allocations made by the thread running the service:
+std::atomic<std::size_t> allocations(0);
+thread_local bool count_allocations = false;
+
+}
+
+// Not inlined so that the compiler does not see free() called on the result
+// of a new expression:
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+  if (count_allocations)
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+namespace {
+
+// Query for www.example.com A with an EDNS OPT record:
+const char QUERY[] =
+  "\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x01"
+  "\x03www\x07" "example\x03" "com\x00\x00\x01\x00\x01"
+  "\x00\x00\x29\x10\x00\x00\x00\x00\x00\x00\x00";
+
+// Its answer (with a name in another case, as returned by some servers):
+const char REPLY[] =
+  "\x12\x34\x81\x80\x00\x01\x00\x01\x00\x00\x00\x01"
+  "\x03WWW\x07" "Example\x03" "COM\x00\x00\x01\x00\x01"
+  "\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04\x5d\xb8\xd8\x22"
+  "\x00\x00\x29\x10\x00\x00\x00\x00\x00\x00\x00";
+
+// REFUSED without question, a valid answer to any query:
+const char REFUSED[] =
+  "\x12\x34\x81\x85\x00\x00\x00\x00\x00\x00\x00\x00";
+
+// NOERROR without question, which does not answer the query:
+const char EMPTY[] =
+  "\x12\x34\x81\x80\x00\x00\x00\x00\x00\x00\x00\x00";
+
+// Answer for another name:
+const char OTHER[] =
+  "\x12\x34\x81\x80\x00\x01\x00\x00\x00\x00\x00\x00"
+  "\x03www\x07" "example\x03" "net\x00\x00\x01\x00\x01";
+
+bool valid_reply(const char* reply, std::size_t size)
+{
+  dnsfwd::message_view request;
+  dnsfwd::message_view response;
+  return request.parse(QUERY, sizeof(QUERY) - 1)
+    && response.parse(reply, size) && response.qr()
+    && dnsfwd::same_question(request, response);
+}
+
+// Check the validation of a few replies:
+void check_replies()
+{
+  if (!valid_reply(REPLY, sizeof(REPLY) - 1)
+      || !valid_reply(REFUSED, sizeof(REFUSED) - 1)
+      || valid_reply(EMPTY, sizeof(EMPTY) - 1)
+      || valid_reply(OTHER, sizeof(OTHER) - 1))
+    throw std::runtime_error("Invalid validation of the replies");
+}
+
+// Validation of a reply as done by the client: parse the request and the
+// reply and compare their questions.
+void bench_parse(std::size_t iterations)
+{
+  check_replies();
+
+  // Copies which the compiler cannot see through:
+  std::string query(QUERY, sizeof(QUERY) - 1);
+  std::string reply(REPLY, sizeof(REPLY) - 1);
+  volatile std::size_t matches = 0;
+
+  clock_type::time_point start = clock_type::now();
+  for (std::size_t i = 0; i != iterations; ++i) {
+    dnsfwd::message_view request;
+    dnsfwd::message_view response;
+    if (request.parse(query.data(), query.size())
+        && response.parse(reply.data(), reply.size()) && response.qr()
+        && dnsfwd::same_question(request, response))
+      matches = matches + 1;
+  }
+  double elapsed = std::chrono::duration<double, std::nano>(
+    clock_type::now() - start).count();
+  if (matches != iterations)
+    throw std::runtime_error("The reply does not match the query");
+
+  start = clock_type::now();
+  for (std::size_t i = 0; i != iterations; ++i) {
+    dnsfwd::message_view request;
+    if (request.parse(query.data(), query.size())
+        && dnsfwd::udp_response_size(request) == 4096)
+      matches = matches + 1;
+  }
+  double edns = std::chrono::duration<double, std::nano>(
+    clock_type::now() - start).count();
+
+  std::cout << "parse: " << elapsed / iterations
+    << " ns per reply validation, " << edns / iterations
+    << " ns per EDNS payload size lookup\n";
+}
+
+sockaddr_in make_address(const char* address, std::uint16_t port)
+{
+  sockaddr_in res;
+  std::memset(&res, 0, sizeof(res));
+  res.sin_family = AF_INET;
+  res.sin_port = htons(port);
+  inet_pton(AF_INET, address, &res.sin_addr);
+  return res;
+}
+
+// Bind a socket to a free port of the given address:
+int bound_socket(int type, const char* address)
+{
+  int fd = socket(AF_INET, type, 0);
+  sockaddr_in local = make_address(address, 0);
+  if (fd < 0 || bind(fd, (const sockaddr*) &local, sizeof(local)) != 0)
+    throw std::runtime_error(std::string("Could not bind to ") + address);
+  return fd;
+}
+
+std::uint16_t local_port(int fd)
+{
+  sockaddr_in local;
+  socklen_t size = sizeof(local);
+  getsockname(fd, (sockaddr*) &local, &size);
+  return ntohs(local.sin_port);
+}
+
+bool read_full(int fd, char* data, std::size_t size)
+{
+  while (size != 0) {
+    ssize_t res = read(fd, data, size);
+    if (res <= 0)
+      return false;
+    data += res;
+    size -= res;
+  }
+  return true;
+}
+
+// Answer the queries of a connection in order with their question, at most
+// rate answers per second (0 for no limit):
+void serve_upstream_connection(int fd, double rate)
+{
+  clock_type::duration interval = rate == 0 ? clock_type::duration::zero()
+    : std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(1 / rate));
+  clock_type::time_point next = clock_type::now();
+  char message[2 + 65535];
+  while (read_full(fd, message, 2)) {
+    std::size_t size = ((unsigned char) message[0] << 8)
+      | (unsigned char) message[1];
+    if (!read_full(fd, message + 2, size))
+      break;
+    message[2 + 2] |= 0x80;
+    if (rate != 0) {
+      next = std::max(next + interval, clock_type::now());
+      std::this_thread::sleep_until(next);
+    }
+    if (write(fd, message, 2 + size) != (ssize_t) (2 + size))
+      break;
+  }
+  close(fd);
+}
+
+// Start a DNS/TCP upstream in the background and return its port:
+std::uint16_t start_upstream(double rate)
+{
+  int fd = bound_socket(SOCK_STREAM, "127.0.0.1");
+  if (listen(fd, 16) != 0)
+    throw std::runtime_error("Could not listen");
+  std::thread([fd, rate]() {
+    while (true) {
+      int connection = accept(fd, nullptr, nullptr);
+      if (connection >= 0)
+        std::thread(serve_upstream_connection, connection, rate).detach();
+    }
+  }).detach();
+  return local_port(fd);
+}
+
+// UDP client socket connected to the service:
+int client_socket(const char* address, std::uint16_t port)
+{
+  int fd = bound_socket(SOCK_DGRAM, address);
+  sockaddr_in server = make_address("127.0.0.1", port);
+  if (connect(fd, (const sockaddr*) &server, sizeof(server)) != 0)
+    throw std::runtime_error("Could not connect the client");
+  timeval timeout = { 0, 100000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+void send_query(int fd, std::uint16_t id)
+{
+  char query[sizeof(QUERY) - 1];
+  std::memcpy(query, QUERY, sizeof(query));
+  std::memcpy(query, &id, sizeof(id));
+  send(fd, query, sizeof(query), 0);
+}
+
+// Receive a reply and return its ID (or -1 after the socket timeout):
+int receive_reply(int fd)
+{
+  char reply[dnsfwd::MAX_QUERY_SIZE];
+  ssize_t size = recv(fd, reply, sizeof(reply), 0);
+  if (size < (ssize_t) sizeof(std::uint16_t))
+    return -1;
+  std::uint16_t id;
+  std::memcpy(&id, reply, sizeof(id));
+  return id;
+}
+
+// Run the service on the calling thread with the given server socket, and
+// the load in another thread until it returns. The server socket is moved
+// to the file descriptor 3: it must be the first one opened.
+void run_service(dnsfwd::config config, int server_fd,
+  std::function<void()> const& load)
+{
+  // The service takes the socket as if it was passed by systemd (before the
+  // io_service uses the file descriptor):
+  if (server_fd != 3) {
+    if (dup2(server_fd, 3) < 0)
+      throw std::runtime_error("Could not move the server socket");
+    close(server_fd);
+  }
+  config.listen_fds = 1;
+
+  boost::asio::io_service io_service;
+  dnsfwd::service service(io_service, std::move(config));
+  std::thread load_thread([&io_service, &load]() {
+    load();
+    io_service.stop();
+  });
+  count_allocations = true;
+  io_service.run();
+  count_allocations = false;
+  load_thread.join();
+}
+
+dnsfwd::config service_config(std::uint16_t upstream_port)
+{
+  dnsfwd::config config;
+  dnsfwd::endpoint upstream;
+  upstream.name = "127.0.0.1";
+  upstream.port = std::to_string(upstream_port);
+  config.connect_tcp.push_back(upstream);
+  return config;
+}
+
+// Allocations of the service per forwarded query, once the connection and
+// the buffers are established. The queries are sent one at a time.
+void bench_allocations(std::size_t queries)
+{
+  int server = bound_socket(SOCK_DGRAM, "127.0.0.1");
+  std::uint16_t port = local_port(server);
+  dnsfwd::config config = service_config(start_upstream(0));
+
+  std::size_t lost = 0;
+  std::size_t count = 0;
+  double elapsed = 0;
+  run_service(std::move(config), server, [&]() {
+    int fd = client_socket("127.0.0.1", port);
+    auto exchange = [fd](std::uint16_t id) {
+      send_query(fd, id);
+      int res;
+      while ((res = receive_reply(fd)) >= 0)
+        if (res == id)
+          return true;
+      return false;
+    };
+    const std::size_t WARMUP = 1000;
+    for (std::size_t i = 0; i != WARMUP; ++i)
+      exchange(i);
+    std::size_t before = allocations.load();
+    clock_type::time_point start = clock_type::now();
+    for (std::size_t i = 0; i != queries; ++i)
+      if (!exchange(WARMUP + i))
+        lost++;
+    elapsed = std::chrono::duration<double, std::micro>(
+      clock_type::now() - start).count();
+    count = allocations.load() - before;
+    close(fd);
+  });
+
+  std::cout << "allocations: " << (double) count / queries
+    << " allocations per forwarded query, " << elapsed / queries
+    << " us per query";
+  if (lost)
+    std::cout << " (" << lost << " queries not answered)";
+  std::cout << "\n";
+}
+
+// UDP client sending queries at a given rate and recording the latency of
+// their answers:
+struct load_client {
+  int fd;
+  double rate;
+  std::vector<std::atomic<std::int64_t>> sent;
+  std::size_t count = 0;
+  std::vector<double> latencies;
+
+  load_client(const char* address, std::uint16_t port, double rate)
+    : fd(client_socket(address, port)), rate(rate), sent(65536) {}
+
+  void send_until(clock_type::time_point end)
+  {
+    clock_type::duration interval =
+      std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(1 / rate));
+    for (clock_type::time_point next = clock_type::now(); next < end;
+        next += interval) {
+      std::this_thread::sleep_until(next);
+      std::uint16_t id = count++;
+      sent[id] = clock_type::now().time_since_epoch().count();
+      send_query(fd, id);
+    }
+  }
+
+  void receive_until(std::atomic<bool> const& stop)
+  {
+    while (!stop) {
+      int id = receive_reply(fd);
+      if (id < 0)
+        continue;
+      clock_type::duration latency = clock_type::now().time_since_epoch()
+        - clock_type::duration(sent[id].load());
+      latencies.push_back(
+        std::chrono::duration<double, std::milli>(latency).count());
+    }
+  }
+
+  double percentile(double p)
+  {
+    if (latencies.empty())
+      return 0;
+    std::sort(latencies.begin(), latencies.end());
+    return latencies[std::min<std::size_t>(
+      latencies.size() * p, latencies.size() - 1)];
+  }
+};
+
+// A noisy client sends twice what the upstream can answer while two quiet
+// clients send 100 queries/s: one with the address of the noisy client
+// (127.0.0.1, sharing its flow of the upstream queue) and one with another
+// address (127.0.0.2, with its own flow).
+void bench_noisy(double duration)
+{
+  const double UPSTREAM_RATE = 5000;
+  int server = bound_socket(SOCK_DGRAM, "127.0.0.1");
+  std::uint16_t port = local_port(server);
+  dnsfwd::config config = service_config(start_upstream(UPSTREAM_RATE));
+  config.max_inflight = 16;
+
+  load_client noisy("127.0.0.1", port, 2 * UPSTREAM_RATE);
+  load_client shared("127.0.0.1", port, 100);
+  load_client separate("127.0.0.2", port, 100);
+  load_client* clients[] = { &noisy, &shared, &separate };
+  run_service(std::move(config), server, [&]() {
+    clock_type::time_point end = clock_type::now()
+      + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(duration));
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    for (load_client* client : clients) {
+      threads.emplace_back(&load_client::send_until, client, end);
+      threads.emplace_back(&load_client::receive_until, client, std::cref(stop));
+    }
+    // Leave time for the queued queries to be answered or expire:
+    std::this_thread::sleep_until(end + std::chrono::seconds(3));
+    stop = true;
+    for (std::thread& thread : threads)
+      thread.join();
+  });
+
+  std::cout << std::fixed << std::setprecision(1)
+    << "noisy: quiet client p50/p99 " << shared.percentile(0.5) << "/"
+    << shared.percentile(0.99) << " ms in the flow of the noisy one ("
+    << shared.count - shared.latencies.size() << " lost), "
+    << separate.percentile(0.5) << "/" << separate.percentile(0.99)
+    << " ms in its own flow (" << separate.count - separate.latencies.size()
+    << " lost), " << noisy.latencies.size() << " of the " << noisy.count
+    << " queries of the noisy client answered\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  using boost::program_options::options_description;
+  using boost::program_options::positional_options_description;
+  using boost::program_options::value;
+  using boost::program_options::variables_map;
+
+  options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "help")
+    ("benchmark", value<std::string>()->default_value("parse"), "benchmark to run (parse, allocations, noisy)")
+    ("iterations", value<std::size_t>()->default_value(10000000), "iterations of the parse benchmark")
+    ("queries", value<std::size_t>()->default_value(20000), "queries of the allocations benchmark")
+    ("duration", value<double>()->default_value(5), "duration of the noisy benchmark in seconds")
+    ("loglevel", value<int>()->default_value(LOG_WARNING), "loglevel of the service (0--8)")
+    ;
+  positional_options_description positional;
+  positional.add("benchmark", 1);
+
+  try {
+    variables_map vm;
+    store(boost::program_options::command_line_parser(argc, argv)
+      .options(desc).positional(positional).run(), vm);
+    notify(vm);
+    if (vm.count("help")) {
+      std::cerr << "Usage: dnsfwd-bench [options] [benchmark]\n" << desc << "\n";
+      return 1;
+    }
+
+    dnsfwd::loglevel = vm["loglevel"].as<int>();
+    std::string benchmark = vm["benchmark"].as<std::string>();
+    if (benchmark == "parse") {
+      bench_parse(vm["iterations"].as<std::size_t>());
+    } else if (benchmark == "allocations") {
+      bench_allocations(vm["queries"].as<std::size_t>());
+    } else if (benchmark == "noisy") {
+      bench_noisy(vm["duration"].as<double>());
+    } else {
+      std::cerr << "Unknown benchmark " << benchmark << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  catch (std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}
@@ -0,0 +1,151 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Compile a list of domain names (one per line or in the hosts file format)
+// into a blocklist file which can be mapped by dnsfwd (--blocklist).
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "dnsfwd.hpp"
+
+namespace {
+
+const std::uint32_t BLOOM_HASHES = 7;
+const std::uint64_t BLOOM_BITS_PER_NAME = 10;
+
+bool is_address(std::string const& token)
+{
+  return token.find(':') != std::string::npos
+    || token.find_first_not_of("0123456789.") == std::string::npos;
+}
+
+void read_names(std::istream& input, std::vector<std::uint64_t>& keys,
+  std::size_t& invalid)
+{
+  std::string line;
+  std::string wire;
+  while (std::getline(input, line)) {
+    std::size_t comment = line.find('#');
+    if (comment != std::string::npos)
+      line.resize(comment);
+    std::istringstream tokens(line);
+    std::string token;
+    while (tokens >> token) {
+      if (is_address(token))
+        continue;
+      if (token.compare(0, 2, "*.") == 0)
+        token.erase(0, 2);
+      if (!token.empty() && token.back() == '.')
+        token.pop_back();
+      if (!dnsfwd::wire_name(token, wire)) {
+        invalid++;
+        continue;
+      }
+      keys.push_back(dnsfwd::blocklist_key(
+        dnsfwd::hash_name(wire.data(), wire.size())));
+    }
+  }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "Usage: dnsfwd-blocklist OUTPUT [INPUT...]\n";
+    return 1;
+  }
+
+  std::vector<std::uint64_t> keys;
+  std::size_t invalid = 0;
+  if (argc == 2) {
+    read_names(std::cin, keys, invalid);
+  } else {
+    for (int i = 2; i < argc; ++i) {
+      std::ifstream input(argv[i]);
+      if (!input) {
+        std::cerr << "Could not open " << argv[i] << "\n";
+        return 1;
+      }
+      read_names(input, keys, invalid);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  dnsfwd::blocklist_header header;
+  std::memcpy(header.magic, dnsfwd::BLOCKLIST_MAGIC, sizeof(header.magic));
+  header.version = dnsfwd::BLOCKLIST_VERSION;
+  header.bloom_hashes = BLOOM_HASHES;
+  header.bloom_bits = 64;
+  while (header.bloom_bits < keys.size() * BLOOM_BITS_PER_NAME)
+    header.bloom_bits *= 2;
+  header.count = keys.size();
+
+  std::vector<std::uint64_t> bloom(header.bloom_bits / 64);
+  std::uint64_t mask = header.bloom_bits - 1;
+  std::vector<std::uint32_t> buckets(dnsfwd::BLOCKLIST_BUCKETS + 1);
+  for (std::uint64_t key : keys) {
+    std::uint64_t h1 = key;
+    std::uint64_t h2 = (key >> 32) | (key << 32) | 1;
+    for (std::uint32_t i = 0; i != BLOOM_HASHES; ++i) {
+      std::uint64_t bit = (h1 + i * h2) & mask;
+      bloom[bit / 64] |= (std::uint64_t) 1 << (bit % 64);
+    }
+    buckets[(key >> 48) + 1]++;
+  }
+  for (std::size_t i = 0; i != dnsfwd::BLOCKLIST_BUCKETS; ++i)
+    buckets[i + 1] += buckets[i];
+  if (buckets.size() % 2)
+    buckets.push_back(0);
+
+  // The file may be mapped by a running dnsfwd: truncating it would crash
+  // it. A new file is written next to it and renamed over it instead.
+  std::string path = std::string(argv[1]) + ".tmp." + std::to_string(getpid());
+  std::ofstream output(path, std::ios::binary | std::ios::trunc);
+  output.write((const char*) &header, sizeof(header));
+  output.write((const char*) bloom.data(), bloom.size() * sizeof(bloom[0]));
+  output.write((const char*) buckets.data(), buckets.size() * sizeof(buckets[0]));
+  output.write((const char*) keys.data(), keys.size() * sizeof(keys[0]));
+  output.close();
+  if (!output || std::rename(path.c_str(), argv[1]) != 0) {
+    std::cerr << "Could not write " << argv[1] << "\n";
+    std::remove(path.c_str());
+    return 1;
+  }
+
+  std::cerr << keys.size() << " names, " << invalid << " invalid\n";
+  return 0;
+}
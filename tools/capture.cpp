@@ -0,0 +1,229 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Extract the DNS queries of a packet capture (pcap format, as written by
+// tcpdump -w) into a compact query stream which can be replayed against
+// dnsfwd with dnsfwd-replay.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "dnsfwd.hpp"
+#include "capture.hpp"
+
+namespace {
+
+const std::uint32_t PCAP_MAGIC = 0xa1b2c3d4;
+const std::uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+
+const std::uint32_t LINKTYPE_NULL = 0;
+const std::uint32_t LINKTYPE_ETHERNET = 1;
+const std::uint32_t LINKTYPE_RAW = 101;
+const std::uint32_t LINKTYPE_RAW_OLD = 12;
+const std::uint32_t LINKTYPE_LINUX_SLL = 113;
+
+const std::uint16_t ETHERTYPE_IPV4 = 0x0800;
+const std::uint16_t ETHERTYPE_IPV6 = 0x86DD;
+const std::uint16_t ETHERTYPE_VLAN = 0x8100;
+
+const std::uint8_t PROTOCOL_UDP = 17;
+
+std::uint16_t read_u16(const unsigned char* p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+std::uint32_t swap_u32(std::uint32_t value)
+{
+  return (value >> 24) | ((value >> 8) & 0xFF00)
+    | ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+struct packet {
+  std::string source;
+  std::uint16_t port;
+  const unsigned char* payload;
+  std::size_t size;
+};
+
+// Find the UDP datagram of an IP packet:
+bool parse_ip(const unsigned char* p, std::size_t size, packet& res)
+{
+  if (size < 1)
+    return false;
+  const unsigned char* udp;
+  std::size_t udp_size;
+  if ((p[0] >> 4) == 4) {
+    std::size_t header_size = (p[0] & 0xF) * 4;
+    if (size < 20 || header_size < 20 || size < header_size)
+      return false;
+    // Fragments are ignored:
+    if (p[9] != PROTOCOL_UDP || (read_u16(p + 6) & 0x3FFF) != 0)
+      return false;
+    // The packets truncated by the capture are ignored:
+    std::size_t total_length = read_u16(p + 2);
+    if (total_length < header_size + 8 || total_length > size)
+      return false;
+    res.source.assign((const char*) p + 12, 4);
+    udp = p + header_size;
+    udp_size = total_length - header_size;
+  } else if ((p[0] >> 4) == 6) {
+    // Extension headers are not supported:
+    if (size < 40 || p[6] != PROTOCOL_UDP)
+      return false;
+    if (read_u16(p + 4) > size - 40)
+      return false;
+    res.source.assign((const char*) p + 8, 16);
+    udp = p + 40;
+    udp_size = read_u16(p + 4);
+  } else {
+    return false;
+  }
+  if (udp_size < 8)
+    return false;
+  res.port = read_u16(udp + 2);
+  res.payload = udp + 8;
+  res.size = std::min<std::size_t>(udp_size, read_u16(udp + 4)) - 8;
+  return read_u16(udp + 4) >= 8;
+}
+
+bool parse_link(std::uint32_t linktype,
+  const unsigned char* p, std::size_t size, packet& res)
+{
+  std::uint16_t ethertype;
+  switch (linktype) {
+  case LINKTYPE_NULL:
+    // The address family is not needed, the IP version is checked:
+    if (size < 4)
+      return false;
+    return parse_ip(p + 4, size - 4, res);
+  case LINKTYPE_RAW:
+  case LINKTYPE_RAW_OLD:
+    return parse_ip(p, size, res);
+  case LINKTYPE_LINUX_SLL:
+    if (size < 16)
+      return false;
+    ethertype = read_u16(p + 14);
+    p += 16;
+    size -= 16;
+    break;
+  case LINKTYPE_ETHERNET:
+    if (size < 14)
+      return false;
+    ethertype = read_u16(p + 12);
+    p += 14;
+    size -= 14;
+    while (ethertype == ETHERTYPE_VLAN && size >= 4) {
+      ethertype = read_u16(p + 2);
+      p += 4;
+      size -= 4;
+    }
+    break;
+  default:
+    return false;
+  }
+  if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+    return false;
+  return parse_ip(p, size, res);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || argc > 4) {
+    std::cerr << "Usage: dnsfwd-capture INPUT.pcap OUTPUT [PORT]\n";
+    return 1;
+  }
+  std::uint16_t port = argc == 4 ? std::atoi(argv[3]) : 53;
+
+  std::ifstream input(argv[1], std::ios::binary);
+  if (!input) {
+    std::cerr << "Could not open " << argv[1] << "\n";
+    return 1;
+  }
+  std::uint32_t header[6];
+  if (!input.read((char*) header, sizeof(header))) {
+    std::cerr << "Invalid capture " << argv[1] << "\n";
+    return 1;
+  }
+  bool swapped = header[0] == swap_u32(PCAP_MAGIC)
+    || header[0] == swap_u32(PCAP_MAGIC_NS);
+  std::uint32_t magic = swapped ? swap_u32(header[0]) : header[0];
+  if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) {
+    std::cerr << "Unsupported capture format (pcapng is not supported)\n";
+    return 1;
+  }
+  std::uint32_t fraction = magic == PCAP_MAGIC_NS ? 1000 : 1;
+  std::uint32_t linktype = swapped ? swap_u32(header[5]) : header[5];
+
+  std::ofstream output(argv[2], std::ios::binary | std::ios::trunc);
+  dnsfwd::capture_writer writer(output);
+
+  std::uint64_t first = 0;
+  std::size_t packets = 0, queries = 0;
+  std::vector<unsigned char> data;
+  std::uint32_t record[4];
+  while (input.read((char*) record, sizeof(record))) {
+    if (swapped)
+      for (std::uint32_t& field : record)
+        field = swap_u32(field);
+    data.resize(record[2]);
+    if (!input.read((char*) data.data(), data.size()))
+      break;
+    packets++;
+
+    packet packet;
+    if (!parse_link(linktype, data.data(), data.size(), packet)
+        || packet.port != port)
+      continue;
+    dnsfwd::message_view query;
+    if (!query.parse((const char*) packet.payload, packet.size)
+        || query.qr() || query.opcode() != 0 || !query.qname())
+      continue;
+
+    std::uint64_t time = (std::uint64_t) record[0] * 1000000
+      + record[1] / fraction;
+    if (queries == 0)
+      first = time;
+    writer.add(time >= first ? time - first : 0, packet.source,
+      query.qtype(), query.qname(), query.qname_size());
+    queries++;
+  }
+
+  output.close();
+  if (!output) {
+    std::cerr << "Could not write " << argv[2] << "\n";
+    return 1;
+  }
+  std::cerr << packets << " packets, " << queries << " queries from "
+    << writer.sources() << " sources\n";
+  return 0;
+}
@@ -0,0 +1,167 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DNSFWD_CAPTURE_HPP
+#define DNSFWD_CAPTURE_HPP
+
+// Compact query stream written by dnsfwd-capture and read by dnsfwd-replay.
+//
+// The file starts with CAPTURE_MAGIC followed by one record per query:
+//
+// * time since the previous query in microseconds (varint);
+// * source index (varint): the sources are numbered in order of appearance
+//   and a new source is followed by its address (length byte and bytes);
+// * QTYPE (16 bits, big endian);
+// * QNAME in wire format (length byte and bytes).
+
+#include <cstdint>
+#include <algorithm>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace dnsfwd {
+
+const char CAPTURE_MAGIC[8] = { 'D', 'N', 'S', 'F', 'W', 'D', 'Q', 1 };
+
+struct capture_record {
+  std::uint64_t time; // microseconds since the first query
+  std::uint32_t source;
+  std::uint16_t qtype;
+  std::string qname;
+};
+
+class capture_writer {
+public:
+  explicit capture_writer(std::ostream& output)
+    : output_(&output), last_time_(0)
+  {
+    output_->write(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+  }
+  // Add a query from a source address (in network byte order):
+  void add(std::uint64_t time, std::string const& source,
+    std::uint16_t qtype, const char* qname, std::size_t qname_size)
+  {
+    auto inserted = sources_.insert(
+      std::make_pair(source, (std::uint32_t) sources_.size()));
+    this->put_varint(time >= last_time_ ? time - last_time_ : 0);
+    this->put_varint(inserted.first->second);
+    if (inserted.second) {
+      output_->put((char) source.size());
+      output_->write(source.data(), source.size());
+    }
+    output_->put((char) (qtype >> 8));
+    output_->put((char) qtype);
+    output_->put((char) qname_size);
+    output_->write(qname, qname_size);
+    if (time > last_time_)
+      last_time_ = time;
+  }
+  std::size_t sources() const
+  {
+    return sources_.size();
+  }
+private:
+  void put_varint(std::uint64_t value)
+  {
+    while (value >= 0x80) {
+      output_->put((char) (0x80 | (value & 0x7F)));
+      value >>= 7;
+    }
+    output_->put((char) value);
+  }
+private:
+  std::ostream* output_;
+  std::uint64_t last_time_;
+  std::map<std::string, std::uint32_t> sources_;
+};
+
+class capture_reader {
+public:
+  explicit capture_reader(std::istream& input)
+    : input_(&input), time_(0)
+  {
+    char magic[sizeof(CAPTURE_MAGIC)];
+    valid_ = input_->read(magic, sizeof(magic))
+      && std::equal(magic, magic + sizeof(magic), CAPTURE_MAGIC);
+  }
+  bool valid() const
+  {
+    return valid_;
+  }
+  bool next(capture_record& record)
+  {
+    std::uint64_t delta, source;
+    if (!this->get_varint(delta) || !this->get_varint(source))
+      return false;
+    if (source == sources_.size()) {
+      int size = input_->get();
+      if (size < 0)
+        return false;
+      std::string address(size, '\0');
+      if (!input_->read(&address[0], size))
+        return false;
+      sources_.push_back(address);
+    } else if (source > sources_.size()) {
+      return false;
+    }
+    unsigned char header[3];
+    if (!input_->read((char*) header, sizeof(header)))
+      return false;
+    time_ += delta;
+    record.time = time_;
+    record.source = source;
+    record.qtype = (header[0] << 8) | header[1];
+    record.qname.resize(header[2]);
+    return (bool) input_->read(&record.qname[0], header[2]);
+  }
+  std::vector<std::string> const& sources() const
+  {
+    return sources_;
+  }
+private:
+  bool get_varint(std::uint64_t& value)
+  {
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      int c = input_->get();
+      if (c < 0)
+        return false;
+      value |= (std::uint64_t) (c & 0x7F) << shift;
+      if (!(c & 0x80))
+        return true;
+    }
+    return false;
+  }
+private:
+  std::istream* input_;
+  std::uint64_t time_;
+  std::vector<std::string> sources_;
+  bool valid_;
+};
+
+}
+
+#endif
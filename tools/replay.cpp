@@ -0,0 +1,327 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Replay a query stream recorded by dnsfwd-capture against a DNS server
+// (typically dnsfwd) at the original pace or faster and report the latency
+// percentiles. With --compare, each query is also sent to a reference
+// server and the answers are compared.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+
+#include "dnsfwd.hpp"
+#include "capture.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+const std::size_t MAX_EXAMPLES = 10;
+
+struct transaction {
+  clock_type::time_point sent;
+  // For the target and the reference server (-1 until answered):
+  std::int64_t latency[2] = { -1, -1 };
+  unsigned rcode[2];
+  std::uint16_t ancount[2];
+};
+
+class replay {
+public:
+  replay(boost::asio::io_service& io_service,
+    std::vector<dnsfwd::capture_record> records,
+    std::vector<boost::asio::ip::udp::endpoint> servers,
+    std::size_t sockets, double speed, std::chrono::milliseconds timeout);
+  void start();
+  int report() const;
+private:
+  struct socket {
+    socket(boost::asio::io_service& io_service)
+      : socket_(io_service), transactions(1 << 16), next_id(0), buffer(4096) {}
+    boost::asio::ip::udp::socket socket_;
+    // Transaction (plus one) of each message ID:
+    std::vector<std::uint32_t> transactions;
+    std::uint16_t next_id;
+    std::vector<char> buffer;
+  };
+  void on_timer(const boost::system::error_code& error);
+  void send(std::size_t index);
+  void receive(std::size_t server, std::size_t index);
+  void on_receive(std::size_t server, std::size_t index,
+    const boost::system::error_code& error, std::size_t size);
+private:
+  boost::asio::io_service* io_service_;
+  std::vector<dnsfwd::capture_record> records_;
+  std::vector<boost::asio::ip::udp::endpoint> servers_;
+  std::vector<std::vector<std::unique_ptr<socket>>> sockets_;
+  std::vector<transaction> transactions_;
+  double speed_;
+  std::chrono::milliseconds timeout_;
+  boost::asio::steady_timer timer_;
+  clock_type::time_point start_;
+  std::size_t next_;
+};
+
+replay::replay(boost::asio::io_service& io_service,
+    std::vector<dnsfwd::capture_record> records,
+    std::vector<boost::asio::ip::udp::endpoint> servers,
+    std::size_t sockets, double speed, std::chrono::milliseconds timeout)
+  : io_service_(&io_service), records_(std::move(records)),
+    servers_(std::move(servers)), transactions_(records_.size()),
+    speed_(speed), timeout_(timeout), timer_(io_service), next_(0)
+{
+  // The queries of a source are always sent from the same socket:
+  sockets_.resize(servers_.size());
+  for (std::size_t i = 0; i != servers_.size(); ++i)
+    for (std::size_t j = 0; j != sockets; ++j) {
+      sockets_[i].push_back(std::unique_ptr<socket>(new socket(io_service)));
+      sockets_[i].back()->socket_.open(servers_[i].protocol());
+      this->receive(i, j);
+    }
+}
+
+void replay::start()
+{
+  start_ = clock_type::now();
+  this->on_timer(boost::system::error_code());
+}
+
+void replay::on_timer(const boost::system::error_code& error)
+{
+  if (error)
+    return;
+  if (next_ == records_.size()) {
+    io_service_->stop();
+    return;
+  }
+  clock_type::time_point now = clock_type::now();
+  clock_type::time_point when;
+  while (next_ != records_.size()) {
+    when = start_ + std::chrono::microseconds(
+      (std::int64_t) (records_[next_].time / speed_));
+    if (when > now)
+      break;
+    this->send(next_++);
+  }
+  // Wait for the last replies:
+  if (next_ == records_.size())
+    when = now + timeout_;
+  timer_.expires_at(when);
+  timer_.async_wait(boost::bind(&replay::on_timer, this,
+    boost::asio::placeholders::error));
+}
+
+void replay::send(std::size_t index)
+{
+  dnsfwd::capture_record const& record = records_[index];
+  transactions_[index].sent = clock_type::now();
+  for (std::size_t i = 0; i != servers_.size(); ++i) {
+    socket& s = *sockets_[i][record.source % sockets_[i].size()];
+    std::uint16_t id = s.next_id++;
+    s.transactions[id] = index + 1;
+
+    char query[12 + dnsfwd::MAX_NAME_SIZE + 4] = {
+      (char) (id >> 8), (char) id, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+    std::size_t size = 12;
+    std::memcpy(query + size, record.qname.data(), record.qname.size());
+    size += record.qname.size();
+    query[size++] = record.qtype >> 8;
+    query[size++] = record.qtype;
+    query[size++] = 0;
+    query[size++] = 1;
+
+    boost::system::error_code ec;
+    s.socket_.send_to(boost::asio::buffer(query, size), servers_[i], 0, ec);
+  }
+}
+
+void replay::receive(std::size_t server, std::size_t index)
+{
+  socket& s = *sockets_[server][index];
+  s.socket_.async_receive(
+    boost::asio::buffer(s.buffer),
+    boost::bind(&replay::on_receive, this, server, index,
+      boost::asio::placeholders::error,
+      boost::asio::placeholders::bytes_transferred));
+}
+
+void replay::on_receive(std::size_t server, std::size_t index,
+  const boost::system::error_code& error, std::size_t size)
+{
+  if (error == boost::asio::error::operation_aborted)
+    return;
+  socket& s = *sockets_[server][index];
+  dnsfwd::message_view response;
+  if (!error && response.parse(s.buffer.data(), size) && response.qr()) {
+    std::uint16_t id = ntohs(response.id());
+    std::uint32_t i = s.transactions[id];
+    s.transactions[id] = 0;
+    if (i != 0) {
+      transaction& t = transactions_[i - 1];
+      t.latency[server] = std::chrono::duration_cast<std::chrono::microseconds>(
+        clock_type::now() - t.sent).count();
+      t.rcode[server] = response.rcode();
+      t.ancount[server] = response.ancount();
+    }
+  }
+  this->receive(server, index);
+}
+
+int replay::report() const
+{
+  std::vector<std::int64_t> latencies;
+  std::size_t mismatches = 0;
+  std::vector<std::size_t> examples;
+  for (std::size_t i = 0; i != transactions_.size(); ++i) {
+    transaction const& t = transactions_[i];
+    if (t.latency[0] >= 0)
+      latencies.push_back(t.latency[0]);
+    // The answers are compared by response code and number of records (the
+    // TTLs and the order of the records may differ):
+    if (servers_.size() == 2 && t.latency[0] >= 0 && t.latency[1] >= 0
+        && (t.rcode[0] != t.rcode[1] || t.ancount[0] != t.ancount[1])) {
+      mismatches++;
+      if (examples.size() < MAX_EXAMPLES)
+        examples.push_back(i);
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << records_.size() << " queries, " << latencies.size()
+    << " answered, " << records_.size() - latencies.size() << " lost\n";
+  if (!latencies.empty()) {
+    const double percentiles[] = { 50, 90, 99, 99.9 };
+    std::cout << "latency (us):";
+    for (double p : percentiles)
+      std::cout << " p" << p << " "
+        << latencies[(std::size_t) (p / 100 * (latencies.size() - 1))];
+    std::cout << " max " << latencies.back() << "\n";
+  }
+  if (servers_.size() == 2) {
+    std::cout << mismatches << " mismatches\n";
+    for (std::size_t i : examples) {
+      dnsfwd::capture_record const& r = records_[i];
+      transaction const& t = transactions_[i];
+      std::cout << "  " << dnsfwd::text_name(r.qname.data(), r.qname.size())
+        << " type " << r.qtype << ": rcode " << t.rcode[0] << "/" << t.rcode[1]
+        << ", " << t.ancount[0] << "/" << t.ancount[1] << " answers\n";
+    }
+  }
+  return mismatches == 0 ? 0 : 2;
+}
+
+boost::asio::ip::udp::endpoint parse_server(
+  boost::asio::io_service& io_service, std::string const& server)
+{
+  std::size_t pos = server.rfind(':');
+  std::string host = server.substr(0, pos);
+  std::string port = pos == std::string::npos ? "53" : server.substr(pos + 1);
+  if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+  boost::asio::ip::udp::resolver resolver(io_service);
+  return *resolver.resolve(boost::asio::ip::udp::resolver::query(host, port));
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  using boost::program_options::options_description;
+  using boost::program_options::positional_options_description;
+  using boost::program_options::value;
+  using boost::program_options::variables_map;
+
+  options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "help")
+    ("input", value<std::string>(), "query stream written by dnsfwd-capture")
+    ("target", value<std::string>()->default_value("127.0.0.1:53"), "server to test")
+    ("compare", value<std::string>(), "reference server whose answers are compared")
+    ("speed", value<double>()->default_value(1), "replay speed factor")
+    ("sockets", value<std::size_t>()->default_value(64), "number of source sockets")
+    ("timeout", value<int>()->default_value(2000), "time to wait for the last replies (ms)")
+    ;
+  positional_options_description positional;
+  positional.add("input", 1);
+
+  try {
+    variables_map vm;
+    store(boost::program_options::command_line_parser(argc, argv)
+      .options(desc).positional(positional).run(), vm);
+    notify(vm);
+    if (vm.count("help") || !vm.count("input")) {
+      std::cerr << "Usage: dnsfwd-replay [options] INPUT\n" << desc << "\n";
+      return 1;
+    }
+    double speed = vm["speed"].as<double>();
+    std::size_t sockets = vm["sockets"].as<std::size_t>();
+    if (speed <= 0 || sockets == 0) {
+      std::cerr << "Invalid speed or number of sockets\n";
+      return 1;
+    }
+
+    std::string path = vm["input"].as<std::string>();
+    std::ifstream input(path, std::ios::binary);
+    dnsfwd::capture_reader reader(input);
+    if (!input || !reader.valid()) {
+      std::cerr << "Invalid query stream " << path << "\n";
+      return 1;
+    }
+    std::vector<dnsfwd::capture_record> records;
+    dnsfwd::capture_record record;
+    while (reader.next(record))
+      records.push_back(record);
+
+    boost::asio::io_service io_service;
+    std::vector<boost::asio::ip::udp::endpoint> servers;
+    servers.push_back(parse_server(io_service, vm["target"].as<std::string>()));
+    if (vm.count("compare"))
+      servers.push_back(parse_server(io_service, vm["compare"].as<std::string>()));
+
+    replay replay(io_service, std::move(records), std::move(servers),
+      sockets, speed, std::chrono::milliseconds(vm["timeout"].as<int>()));
+    replay.start();
+    io_service.run();
+    return replay.report();
+  }
+  catch (std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}
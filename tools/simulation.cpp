@@ -0,0 +1,675 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Deterministic simulation of dnsfwd. The service runs unmodified on a
+// virtual clock (see DNSFWD_SIMULATION) with simulated UDP clients and a
+// scripted upstream in the same process. They are connected to it by UNIX
+// sockets instead of the network. The virtual time only advances when
+// everything due has been processed, so that the results do not depend on
+// the speed of the machine and minutes of traffic are simulated in seconds.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/program_options.hpp>
+
+#include "dnsfwd.hpp"
+
+namespace {
+
+typedef std::chrono::nanoseconds nanoseconds;
+
+// Virtual time (it starts at 1s so that the first requests are not seen as
+// expired):
+nanoseconds virtual_now = std::chrono::seconds(1);
+
+const nanoseconds RESOLUTION = std::chrono::microseconds(100);
+
+// Handlers of the service run between two reads of the answers:
+const std::size_t MAX_HANDLERS = 256;
+
+nanoseconds seconds(double value)
+{
+  return nanoseconds((std::int64_t) (value * 1e9));
+}
+
+double milliseconds(nanoseconds value)
+{
+  return value.count() / 1e6;
+}
+
+// Scripted upstream behaviour between two times (in seconds since the
+// start):
+struct phase {
+  enum kind_type {
+    // The queries are not answered:
+    blackhole,
+    // The connections are refused:
+    refuse,
+    // The connections are closed at the start and then every period:
+    reset
+  } kind;
+  double start;
+  double end;
+  double period;
+};
+
+struct scenario {
+  const char* name;
+  const char* description;
+  double duration;
+  // Regular clients and their rate (queries per second):
+  std::size_t clients;
+  double rate;
+  // Rate of an additional noisy client (0 for none):
+  double noisy_rate;
+  // Upstream latency (ms) and its variation:
+  double delay;
+  double jitter;
+  // Queries answered per second by the upstream (0 for no limit):
+  double capacity;
+  // Probability that a query is not answered:
+  double drop;
+  std::vector<phase> phases;
+  // Options of the service:
+  std::size_t max_inflight;
+  int health_interval;
+};
+
+const scenario SCENARIOS[] = {
+  { "steady", "1M queries at 100k queries/s with a 5ms upstream",
+    10, 16, 6250, 0, 5, 2, 0, 0, {}, 0, 0 },
+  { "ids", "the upstream stops answering for 10s: the message IDs of the "
+    "connection are exhausted until the requests expire",
+    80, 4, 5000, 0, 5, 2, 0, 0, { { phase::blackhole, 2, 12, 0 } }, 0, 0 },
+  { "expiry", "the upstream drops 5% of the queries which expire after 60s",
+    90, 8, 1250, 0, 5, 2, 0, 0.05, {}, 0, 0 },
+  { "reconnect", "the upstream closes its connections every 3s and refuses "
+    "them between 10s and 15s",
+    30, 8, 2500, 0, 5, 2, 0, 0,
+    { { phase::reset, 3, 30, 3 }, { phase::refuse, 10, 15, 0 } }, 0, 1 },
+  { "blackhole", "the upstream stops answering between 5s and 15s: every "
+    "query is failed once the health check times out",
+    30, 8, 2500, 0, 5, 2, 0, 0, { { phase::blackhole, 5, 15, 0 } }, 0, 1 },
+  { "noisy", "a client sends 20k queries/s to an upstream answering 10k "
+    "queries/s while 15 others send 100 queries/s",
+    20, 15, 100, 20000, 5, 2, 10000, 0, {}, 64, 0 },
+};
+
+sockaddr_un abstract_address(std::string const& name, socklen_t& size)
+{
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path + 1, name.data(), name.size());
+  size = offsetof(sockaddr_un, sun_path) + 1 + name.size();
+  return address;
+}
+
+int datagram_socket(std::string const& name)
+{
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  socklen_t size;
+  sockaddr_un address = abstract_address(name, size);
+  if (fd < 0 || bind(fd, (sockaddr*) &address, size) != 0)
+    throw std::runtime_error("Could not create the socket " + name);
+  return fd;
+}
+
+std::size_t resident_size()
+{
+  std::ifstream statm("/proc/self/statm");
+  std::size_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Latencies of the answers received during a report interval:
+struct latencies {
+  std::vector<nanoseconds> values;
+  std::size_t failed = 0;
+
+  nanoseconds percentile(double p)
+  {
+    if (values.empty())
+      return nanoseconds(0);
+    std::size_t i = std::min(values.size() - 1, (std::size_t) (values.size() * p));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+  }
+};
+
+class simulation {
+public:
+  simulation(scenario const& s, unsigned seed, dnsfwd::config config);
+  int connect();
+  void run();
+private:
+  struct client {
+    int fd;
+    double rate;
+    bool noisy;
+    nanoseconds next;
+    std::uint16_t id;
+  };
+  struct connection {
+    int fd;
+    std::vector<char> input;
+    std::vector<char> output;
+  };
+  struct reply {
+    nanoseconds time;
+    std::size_t connection;
+    std::vector<char> data;
+    bool operator>(reply const& that) const
+    {
+      return time > that.time;
+    }
+  };
+  bool active(phase::kind_type kind) const;
+  nanoseconds elapsed() const
+  {
+    return virtual_now - start_;
+  }
+  bool send_queries();
+  bool run_service();
+  bool read_answers();
+  bool read_upstream();
+  void on_query(std::size_t connection, const char* data, std::size_t size);
+  bool write_replies();
+  void reset_connections();
+  nanoseconds next_event() const;
+  void report();
+  void summary(std::chrono::steady_clock::duration real);
+private:
+  scenario const& scenario_;
+  std::mt19937_64 random_;
+  std::string prefix_;
+  sockaddr_un server_address_;
+  socklen_t server_address_size_;
+  std::vector<client> clients_;
+  std::vector<connection> connections_;
+  std::priority_queue<reply, std::vector<reply>, std::greater<reply>> replies_;
+  std::vector<nanoseconds> resets_;
+  nanoseconds start_;
+  nanoseconds busy_until_;
+  nanoseconds next_report_;
+  std::unique_ptr<boost::asio::io_service> io_service_;
+  std::unique_ptr<dnsfwd::service> service_;
+  // Regular and noisy clients:
+  latencies latencies_[2];
+  std::size_t sent_;
+  std::size_t answered_;
+  std::size_t failed_;
+  std::size_t connects_;
+  std::size_t peak_size_;
+};
+
+simulation* current_simulation = nullptr;
+
+simulation::simulation(scenario const& s, unsigned seed, dnsfwd::config config)
+  : scenario_(s),
+    random_(seed),
+    prefix_("dnsfwd-sim." + std::to_string(getpid())),
+    start_(virtual_now),
+    busy_until_(virtual_now),
+    next_report_(virtual_now + std::chrono::seconds(1)),
+    sent_(0),
+    answered_(0),
+    failed_(0),
+    connects_(0),
+    peak_size_(0)
+{
+  // The service takes the socket of its server as if it was passed by
+  // systemd (before the io_service uses the file descriptor):
+  int fd = datagram_socket(prefix_ + ".server");
+  if (fd != 3) {
+    if (dup2(fd, 3) < 0)
+      throw std::runtime_error("Could not move the server socket");
+    close(fd);
+  }
+  server_address_ = abstract_address(prefix_ + ".server", server_address_size_);
+  config.listen_fds = 1;
+
+  std::exponential_distribution<double> first(1);
+  for (std::size_t i = 0; i <= s.clients; ++i) {
+    double rate = i == s.clients ? s.noisy_rate : s.rate;
+    if (rate == 0)
+      continue;
+    client c;
+    c.fd = datagram_socket(prefix_ + "." + std::to_string(i));
+    fcntl(c.fd, F_SETFL, O_NONBLOCK);
+    c.rate = rate;
+    c.noisy = i == s.clients;
+    c.next = virtual_now + seconds(first(random_) / rate);
+    c.id = 0;
+    clients_.push_back(c);
+  }
+
+  for (phase const& p : s.phases)
+    resets_.push_back(p.kind == phase::reset
+      ? start_ + seconds(p.start) : nanoseconds::max());
+
+  io_service_.reset(new boost::asio::io_service());
+  service_.reset(new dnsfwd::service(*io_service_, std::move(config)));
+}
+
+bool simulation::active(phase::kind_type kind) const
+{
+  for (phase const& p : scenario_.phases)
+    if (p.kind == kind && elapsed() >= seconds(p.start)
+        && elapsed() < seconds(p.end))
+      return true;
+  return false;
+}
+
+// Upstream connection requested by the service:
+int simulation::connect()
+{
+  if (active(phase::refuse))
+    return -1;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return -1;
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  connection c;
+  c.fd = fds[1];
+  connections_.push_back(std::move(c));
+  connects_++;
+  return fds[0];
+}
+
+// Send the queries which are due. The send time is encoded in the first
+// label of the name to measure the latency of the answers.
+bool simulation::send_queries()
+{
+  bool progress = false;
+  std::exponential_distribution<double> interval(1);
+  for (client& c : clients_) {
+    while (c.next <= virtual_now && elapsed() < seconds(scenario_.duration)) {
+      char query[64] = { (char) (c.id >> 8), (char) c.id, 0x01, 0x00,
+        0, 1, 0, 0, 0, 0, 0, 0 };
+      std::size_t size = dnsfwd::MIN_MESSAGE_SIZE;
+      query[size++] = 16;
+      std::snprintf(query + size, 17, "%016llx",
+        (unsigned long long) virtual_now.count());
+      size += 16;
+      std::memcpy(query + size, "\3sim\0\0\1\0\1", 9);
+      size += 9;
+      if (sendto(c.fd, query, size, 0, (sockaddr*) &server_address_,
+          server_address_size_) < 0) {
+        // The server socket is full: let the service read it first.
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return true;
+        throw std::runtime_error("Could not send a query");
+      }
+      c.id++;
+      c.next += seconds(interval(random_) / c.rate);
+      sent_++;
+      progress = true;
+    }
+  }
+  return progress;
+}
+
+// Run the ready handlers of the service. Their number is bounded as a
+// response to a client whose datagram queue is full is retried as long as
+// the socket is reported writable, which is always the case for a UNIX
+// datagram socket: the client must read its answers in between.
+bool simulation::run_service()
+{
+  std::size_t count = 0;
+  while (count != MAX_HANDLERS && io_service_->poll_one() != 0)
+    count++;
+  return count != 0;
+}
+
+bool simulation::read_answers()
+{
+  bool progress = false;
+  char answer[512];
+  for (client& c : clients_) {
+    while (1) {
+      ssize_t size = recv(c.fd, answer, sizeof(answer), 0);
+      if (size < 0)
+        break;
+      progress = true;
+      dnsfwd::message_view view;
+      if (!view.parse(answer, size) || view.qname_size() < 18)
+        continue;
+      unsigned long long time = std::strtoull(
+        std::string(view.qname() + 1, 16).c_str(), nullptr, 16);
+      latencies& l = latencies_[c.noisy];
+      if (view.rcode() != 0) {
+        failed_++;
+        l.failed++;
+      } else {
+        answered_++;
+        l.values.push_back(virtual_now - nanoseconds(time));
+      }
+    }
+  }
+  return progress;
+}
+
+bool simulation::read_upstream()
+{
+  bool progress = false;
+  char buffer[1 << 16];
+  for (std::size_t i = 0; i != connections_.size(); ++i) {
+    connection& c = connections_[i];
+    while (c.fd >= 0) {
+      ssize_t size = read(c.fd, buffer, sizeof(buffer));
+      if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      progress = true;
+      if (size <= 0) {
+        close(c.fd);
+        c.fd = -1;
+        break;
+      }
+      c.input.insert(c.input.end(), buffer, buffer + size);
+    }
+    std::size_t consumed = 0;
+    while (c.input.size() - consumed >= 2) {
+      const unsigned char* p = (const unsigned char*) c.input.data() + consumed;
+      std::size_t length = (p[0] << 8) | p[1];
+      if (c.input.size() - consumed < 2 + length)
+        break;
+      this->on_query(i, c.input.data() + consumed + 2, length);
+      consumed += 2 + length;
+    }
+    c.input.erase(c.input.begin(), c.input.begin() + consumed);
+  }
+  return progress;
+}
+
+// Schedule the answer of a query (an echo of the question):
+void simulation::on_query(std::size_t connection, const char* data, std::size_t size)
+{
+  std::uniform_real_distribution<double> uniform(0, 1);
+  if (size < dnsfwd::MIN_MESSAGE_SIZE || active(phase::blackhole)
+      || uniform(random_) < scenario_.drop)
+    return;
+
+  nanoseconds time = virtual_now;
+  if (scenario_.capacity != 0) {
+    busy_until_ = std::max(busy_until_, virtual_now)
+      + seconds(1 / scenario_.capacity);
+    time = busy_until_;
+  }
+  double delay = scenario_.delay
+    + scenario_.jitter * (2 * uniform(random_) - 1);
+  time += seconds(std::max(0.0, delay) / 1000);
+
+  reply r;
+  r.time = time;
+  r.connection = connection;
+  r.data.resize(2 + size);
+  r.data[0] = size >> 8;
+  r.data[1] = size;
+  std::memcpy(r.data.data() + 2, data, size);
+  r.data[4] |= 0x80;
+  r.data[5] = (char) 0x80;
+  replies_.push(std::move(r));
+}
+
+bool simulation::write_replies()
+{
+  bool progress = false;
+  while (!replies_.empty() && replies_.top().time <= virtual_now) {
+    reply const& r = replies_.top();
+    connection& c = connections_[r.connection];
+    if (c.fd >= 0)
+      c.output.insert(c.output.end(), r.data.begin(), r.data.end());
+    replies_.pop();
+  }
+  for (connection& c : connections_) {
+    if (c.fd < 0 || c.output.empty())
+      continue;
+    ssize_t size = write(c.fd, c.output.data(), c.output.size());
+    if (size > 0) {
+      c.output.erase(c.output.begin(), c.output.begin() + size);
+      progress = true;
+    }
+  }
+  return progress;
+}
+
+void simulation::reset_connections()
+{
+  for (std::size_t i = 0; i != resets_.size(); ++i) {
+    phase const& p = scenario_.phases[i];
+    if (resets_[i] > virtual_now)
+      continue;
+    for (connection& c : connections_)
+      if (c.fd >= 0) {
+        close(c.fd);
+        c.fd = -1;
+      }
+    resets_[i] += seconds(p.period);
+    if (resets_[i] >= start_ + seconds(p.end))
+      resets_[i] = nanoseconds::max();
+  }
+}
+
+// The time advances to the next event, by steps of the resolution (the
+// events due within a step are handled together) and of 1ms at most (the
+// service timers are not known).
+nanoseconds simulation::next_event() const
+{
+  nanoseconds next = std::min(next_report_,
+    virtual_now + std::chrono::milliseconds(1));
+  for (client const& c : clients_)
+    next = std::min(next, c.next);
+  if (!replies_.empty())
+    next = std::min(next, replies_.top().time);
+  for (nanoseconds reset : resets_)
+    next = std::min(next, reset);
+  return std::max(next, virtual_now + RESOLUTION);
+}
+
+void simulation::run()
+{
+  std::cout << "scenario " << scenario_.name << ": "
+    << scenario_.description << "\n\n";
+  std::cout << "   time  answers/s  failures/s  outstanding   p50 ms   p99 ms   max ms";
+  if (scenario_.noisy_rate != 0)
+    std::cout << "  quiet p50  quiet p99";
+  std::cout << "  rss MiB\n";
+
+  std::chrono::steady_clock::time_point real_start = std::chrono::steady_clock::now();
+  nanoseconds end = start_ + seconds(scenario_.duration);
+  while (virtual_now < end) {
+    this->reset_connections();
+    bool progress = true;
+    while (progress) {
+      progress = this->send_queries();
+      progress = this->run_service() || progress;
+      progress = this->read_upstream() || progress;
+      progress = this->write_replies() || progress;
+      progress = this->read_answers() || progress;
+    }
+    if (virtual_now >= next_report_) {
+      this->report();
+      next_report_ += std::chrono::seconds(1);
+    }
+    virtual_now = this->next_event();
+  }
+  this->summary(std::chrono::steady_clock::now() - real_start);
+}
+
+void simulation::report()
+{
+  std::size_t size = resident_size();
+  peak_size_ = std::max(peak_size_, size);
+  latencies& regular = latencies_[0];
+  latencies& noisy = latencies_[1];
+  std::size_t answers = regular.values.size() + noisy.values.size();
+  std::size_t failures = regular.failed + noisy.failed;
+
+  std::vector<nanoseconds> all = regular.values;
+  all.insert(all.end(), noisy.values.begin(), noisy.values.end());
+  latencies total;
+  total.values = std::move(all);
+  nanoseconds max = total.values.empty() ? nanoseconds(0)
+    : *std::max_element(total.values.begin(), total.values.end());
+
+  std::cout << std::fixed << std::setprecision(1)
+    << std::setw(6) << std::chrono::duration_cast<std::chrono::seconds>(
+      this->elapsed()).count() << "s"
+    << std::setw(11) << answers
+    << std::setw(12) << failures
+    << std::setw(13) << sent_ - answered_ - failed_
+    << std::setw(9) << milliseconds(total.percentile(0.5))
+    << std::setw(9) << milliseconds(total.percentile(0.99))
+    << std::setw(9) << milliseconds(max);
+  if (scenario_.noisy_rate != 0)
+    std::cout << std::setw(11) << milliseconds(regular.percentile(0.5))
+      << std::setw(11) << milliseconds(regular.percentile(0.99));
+  std::cout << std::setw(9) << size / (1024.0 * 1024.0) << std::endl;
+
+  latencies_[0] = latencies();
+  latencies_[1] = latencies();
+}
+
+void simulation::summary(std::chrono::steady_clock::duration real)
+{
+  double elapsed = std::chrono::duration<double>(real).count();
+  std::cout << "\n" << sent_ << " queries, " << answered_ << " answered, "
+    << failed_ << " failed, " << sent_ - answered_ - failed_ << " lost, "
+    << connects_ << " upstream connections\n"
+    << scenario_.duration << "s simulated in " << std::setprecision(2)
+    << elapsed << "s (" << (std::size_t) (sent_ / elapsed)
+    << " queries/s), peak rss " << std::setprecision(1)
+    << peak_size_ / (1024.0 * 1024.0) << " MiB\n";
+}
+
+}
+
+namespace dnsfwd {
+
+const bool clock_type::is_steady;
+
+clock_type::time_point clock_type::now()
+{
+  return time_point(virtual_now);
+}
+
+int simulated_connect()
+{
+  return current_simulation->connect();
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  using boost::program_options::options_description;
+  using boost::program_options::value;
+  using boost::program_options::variables_map;
+
+  options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "help")
+    ("list", "list the scenarios")
+    ("scenario", value<std::string>()->default_value("steady"), "scenario to simulate")
+    ("seed", value<unsigned>()->default_value(1), "seed of the simulated traffic")
+    ("duration", value<double>(), "simulated time in seconds")
+    ("max-inflight", value<std::size_t>(), "maximum number of requests in flight on an upstream connection")
+    ("flow-queue", value<std::size_t>(), "maximum number of queued requests of a client")
+    ("health-interval", value<int>(), "health check interval in seconds (0 to disable)")
+    ("loglevel", value<int>()->default_value(LOG_WARNING), "loglevel (0--8)")
+    ;
+
+  try {
+    variables_map vm;
+    store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+    notify(vm);
+    if (vm.count("help")) {
+      std::cerr << "Usage: dnsfwd-sim [options]\n" << desc << "\n";
+      return 1;
+    }
+    if (vm.count("list")) {
+      for (scenario const& s : SCENARIOS)
+        std::cout << s.name << ": " << s.description << "\n";
+      return 0;
+    }
+
+    std::string name = vm["scenario"].as<std::string>();
+    auto i = std::find_if(std::begin(SCENARIOS), std::end(SCENARIOS),
+      [&name](scenario const& s) { return name == s.name; });
+    if (i == std::end(SCENARIOS)) {
+      std::cerr << "Unknown scenario " << name << "\n";
+      return 1;
+    }
+    scenario s = *i;
+    if (vm.count("duration"))
+      s.duration = vm["duration"].as<double>();
+    if (vm.count("max-inflight"))
+      s.max_inflight = vm["max-inflight"].as<std::size_t>();
+    if (vm.count("health-interval"))
+      s.health_interval = vm["health-interval"].as<int>();
+    dnsfwd::loglevel = vm["loglevel"].as<int>();
+
+    dnsfwd::config config;
+    dnsfwd::endpoint upstream;
+    upstream.name = "upstream.sim";
+    config.connect_tcp.push_back(upstream);
+    config.max_inflight = s.max_inflight;
+    config.health_interval = s.health_interval;
+    if (vm.count("flow-queue"))
+      config.flow_queue = vm["flow-queue"].as<std::size_t>();
+
+    simulation simulation(s, vm["seed"].as<unsigned>(), std::move(config));
+    current_simulation = &simulation;
+    simulation.run();
+    return 0;
+  }
+  catch (std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}